@@ -1,13 +1,45 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a set of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
+// Buffers are found through a hash table on (dev, blockno), each
+// bucket a chain with its own lock, so looking up a cached block
+// takes only that bucket's lock and cpus reading different blocks
+// don't serialize. Buffers are also on one of two replacement
+// lists, under bcache.lock, which only brelse() (when a buffer
+// becomes unused) and a miss (to make or pick a buffer to recycle)
+// take.
+// lock order: bcache.lock, then bucket locks. a miss holds
+// bcache.lock while it takes two buckets' locks, so no other
+// path takes more than one.
+//
+// Replacement is 2Q, so that one big sequential read can't push
+// every inode, bitmap and directory block out of the cache. A block
+// read for the first time goes on the in list, in order of arrival,
+// and stays there however often it's used: a scan touches each of
+// its blocks a few times in a row, which says nothing about reuse.
+// While the in list holds more than a quarter of the cache, the
+// oldest unused block on it is the one recycled, and its number is
+// remembered on the ghost list. A block read again while still on
+// the ghost list has been used twice far apart, and goes on the hot
+// list, which is kept in LRU order. So a scan only displaces other
+// blocks that have been read once.
+//
+// Buffers come from a slab cache. There are NBUF to start with, and
+// a miss makes a new one rather than recycling a cached block until
+// there are NBUF_MAX. When the page allocator runs out, it calls
+// bcache_shrink() to free the unused ones beyond NBUF. If every
+// buffer is in use (all locked or pinned in the log), a miss sleeps
+// until one is released.
+//
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
-// * After changing buffer data, call bwrite to write it to disk.
+// * After changing buffer data, call bwrite to write it to disk
+//     (or bwritev, for several at once).
+// * To have blocks on their way before they're needed, call breadahead.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
@@ -22,70 +54,328 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "stat.h"
+
+#define NGHOST (NBUF_MAX/2)  // block numbers remembered after leaving the in list
+#define NGHOSTHASH 127       // ghost hash chains, about 4 entries each when full
+#define NAHEAD 16            // most reads breadahead() starts at once
+
+struct bucket {
+  struct spinlock lock;  // protects the chain and its buffers' refcnt; changing a
+                         // buffer's dev and blockno also takes bcache.lock
+  struct buf *head;      // chain through hnext
+  uint64 hits;           // lookups that found the block here
+};
+
+static struct kmem_cache *buf_cache;
 
 struct {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  int nbuf;              // buffers that exist, NBUF to NBUF_MAX
+  int nin;               // ...of which are on the in list
+  int nwaiting;          // bget()s asleep until a buffer is unused
+
+  // Linked lists of buffers, through prev/next, most recent
+  // at head.next and least at head.prev. in is in order of
+  // arrival and hot in order of last use.
+  struct buf in;
+  struct buf hot;
+
+  // blocks recently recycled from the in list: a ring, oldest
+  // at ghostnext, whose entries are also hashed on (dev, blockno)
+  // so a miss can look for its block without scanning them all
+  struct {
+    uint dev;            // 0 if the slot is empty
+    uint blockno;
+    int next;            // next entry in its hash chain, or -1
+  } ghost[NGHOST];
+  int ghostnext;
+  int ghosthead[NGHOSTHASH];  // first entry of each chain, or -1
+
+  uint64 misses;
+  uint64 ghosthits;      // misses on a block still on the ghost list
+  uint64 readahead;      // reads breadahead() started; atomic, no lock
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  struct bucket buckets[NBCACHEBUCKET];
 } bcache;
 
+static struct bucket *
+bucket_for(uint dev, uint blockno)
+{
+  return &bcache.buckets[(dev * 31 + blockno) % NBCACHEBUCKET];
+}
+
+// caller holds bcache.lock
+static void
+list_remove(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+  if(!b->hot)
+    bcache.nin--;
+}
+
+// put b at the most recent end of the in or hot list.
+// caller holds bcache.lock
+static void
+list_push(struct buf *b, int hot)
+{
+  struct buf *head = hot ? &bcache.hot : &bcache.in;
+
+  b->hot = hot;
+  b->next = head->next;
+  b->prev = head;
+  head->next->prev = b;
+  head->next = b;
+  if(!hot)
+    bcache.nin++;
+}
+
+static int *
+ghost_chain(uint dev, uint blockno)
+{
+  return &bcache.ghosthead[(dev * 31 + blockno) % NGHOSTHASH];
+}
+
+// empty ghost entry i, taking it off its chain.
+// caller holds bcache.lock
+static void
+ghost_remove(int i)
+{
+  int *pp;
+
+  for(pp = ghost_chain(bcache.ghost[i].dev, bcache.ghost[i].blockno); *pp != i;
+      pp = &bcache.ghost[*pp].next)
+    ;
+  *pp = bcache.ghost[i].next;
+  bcache.ghost[i].dev = 0;
+}
+
+// remember that b's block was recycled from the in list,
+// in place of the oldest entry. caller holds bcache.lock
+static void
+ghost_add(struct buf *b)
+{
+  int i = bcache.ghostnext;
+  int *head;
+
+  if(b->dev == 0)
+    return;
+  if(bcache.ghost[i].dev)
+    ghost_remove(i);
+  head = ghost_chain(b->dev, b->blockno);
+  bcache.ghost[i].dev = b->dev;
+  bcache.ghost[i].blockno = b->blockno;
+  bcache.ghost[i].next = *head;
+  *head = i;
+  bcache.ghostnext = (i + 1) % NGHOST;
+}
+
+// was (dev, blockno) recycled from the in list recently?
+// forgets it if so. caller holds bcache.lock
+static int
+ghost_take(uint dev, uint blockno)
+{
+  for(int i = *ghost_chain(dev, blockno); i >= 0; i = bcache.ghost[i].next){
+    if(bcache.ghost[i].dev == dev && bcache.ghost[i].blockno == blockno){
+      ghost_remove(i);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// a new buffer, not on any list yet.
+// caller holds bcache.lock
+static struct buf*
+buf_new(void)
+{
+  struct buf *b;
+
+  if((b = kmem_cache_alloc(buf_cache)) == 0)
+    return 0;
+  memset(b, 0, sizeof(*b));
+  initsleeplock(&b->lock, "buffer");
+  bcache.nbuf++;
+  return b;
+}
+
 void
 binit(void)
 {
   struct buf *b;
 
   create_lock(&bcache.lock, "bcache");
+  for(int i = 0; i < NBCACHEBUCKET; i++)
+    create_lock(&bcache.buckets[i].lock, "bcache bucket");
+  buf_cache = kmem_cache_create("buf", sizeof(struct buf));
+  for(int i = 0; i < NGHOSTHASH; i++)
+    bcache.ghosthead[i] = -1;
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  // Create the in list of buffers, all of them in
+  // bucket 0 as block 0 until they're first used.
+  // the cache never shrinks below these NBUF.
+  bcache.in.prev = &bcache.in;
+  bcache.in.next = &bcache.in;
+  bcache.hot.prev = &bcache.hot;
+  bcache.hot.next = &bcache.hot;
+  for(int i = 0; i < NBUF; i++){
+    if((b = buf_new()) == 0)
+      panic("binit");
+    list_push(b, 0);
+    b->hnext = bcache.buckets[0].head;
+    bcache.buckets[0].head = b;
   }
 }
 
+// the buffer for block (dev, blockno) in bk, or 0.
+// caller holds bk->lock
+static struct buf*
+bucket_find(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b; b = b->hnext)
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  return 0;
+}
+
+// caller holds bk->lock
+static void
+bucket_remove(struct bucket *bk, struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = &bk->head; *pp != b; pp = &(*pp)->hnext)
+    ;
+  *pp = b->hnext;
+  b->hnext = 0;
+}
+
+// take the least recent unused buffer off the in or hot list
+// and out of its bucket, or return 0 if they're all in use.
+// caller holds bcache.lock and bk->lock (bk may be 0).
+static struct buf*
+take_unused(int hot, struct bucket *bk)
+{
+  struct buf *head = hot ? &bcache.hot : &bcache.in;
+  struct bucket *vbk;
+  struct buf *b;
+
+  for(b = head->prev; b != head; b = b->prev){
+    vbk = bucket_for(b->dev, b->blockno);
+    if(vbk != bk)
+      acquire(&vbk->lock);
+    if(b->refcnt == 0) {
+      bucket_remove(vbk, b);
+      if(vbk != bk)
+        release(&vbk->lock);
+      list_remove(b);
+      if(!hot)
+        ghost_add(b);
+      return b;
+    }
+    if(vbk != bk)
+      release(&vbk->lock);
+  }
+  return 0;
+}
+
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
+// for read-ahead (ahead set), return 0 instead if the block is
+// already cached or there's no buffer to spare without sleeping.
 static struct buf*
-bget(uint dev, uint blockno)
+bget(uint dev, uint blockno, int ahead)
 {
+  struct bucket *bk = bucket_for(dev, blockno);
   struct buf *b;
 
-  acquire(&bcache.lock);
-
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  acquire(&bk->lock);
+  if((b = bucket_find(bk, dev, blockno)) != 0){
+    if(ahead){
+      release(&bk->lock);
+      return 0;
     }
+    b->refcnt++;
+    bk->hits++;
+    release(&bk->lock);
+    acquiresleep(&b->lock);
+    return b;
   }
+  release(&bk->lock);
 
   // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
+  // someone may have read the block in while no lock was held,
+  // so look again once the bucket is locked for good.
+  acquire(&bcache.lock);
+  for(;;){
+    acquire(&bk->lock);
+    if((b = bucket_find(bk, dev, blockno)) != 0){
+      if(ahead){
+        release(&bk->lock);
+        release(&bcache.lock);
+        return 0;
+      }
+      b->refcnt++;
+      bk->hits++;
+      release(&bk->lock);
       release(&bcache.lock);
       acquiresleep(&b->lock);
       return b;
     }
+
+    // under the budget, make a new buffer rather than
+    // throw a cached block out. (with the page allocator
+    // out of memory this fails, and we recycle instead.)
+    if(bcache.nbuf < NBUF_MAX && (b = buf_new()) != 0)
+      goto found;
+
+    // Recycle an unused buffer, from the in list while it's
+    // over its share, else the least recently used hot one.
+    b = 0;
+    if(bcache.nin > bcache.nbuf / 4)
+      b = take_unused(0, bk);
+    if(b == 0)
+      b = take_unused(1, bk);
+    if(b == 0)
+      b = take_unused(0, bk);
+    if(b)
+      goto found;
+
+    // every buffer is in use. wait for one to be released,
+    // then start over, since the block may be cached by then.
+    release(&bk->lock);
+    if(ahead){
+      release(&bcache.lock);
+      return 0;
+    }
+    bcache.nwaiting++;
+    sleep(&bcache.nwaiting, &bcache.lock);
+    bcache.nwaiting--;
+  }
+
+found:
+  bcache.misses++;
+  if(ghost_take(dev, blockno)){
+    bcache.ghosthits++;
+    list_push(b, 1);
+  } else {
+    list_push(b, 0);
   }
-  panic("bget: no buffers");
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  b->hnext = bk->head;
+  bk->head = b;
+  release(&bk->lock);
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -94,9 +384,10 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if(!b->valid) {
     virtio_disk_rw(b, 0);
+    rusage_blockread();
     b->valid = 1;
   }
   return b;
@@ -111,43 +402,171 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
-// Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Write n bufs to disk, all in flight at once.  Must be locked.
 void
-brelse(struct buf *b)
+bwritev(struct buf **bufs, int n)
 {
-  if(!holdingsleep(&b->lock))
-    panic("brelse");
+  for(int i = 0; i < n; i++)
+    if(!holdingsleep(&bufs[i]->lock))
+      panic("bwritev");
+  virtio_disk_rwv(bufs, n, 1);
+}
 
-  releasesleep(&b->lock);
+// drop a reference to b. a hot buffer that becomes unused
+// moves to the most recently used end of the hot list; one
+// on the in list stays where it arrived.
+static void
+bput(struct buf *b)
+{
+  // the buffer can't be recycled or freed while we hold a
+  // reference, so its bucket is steady until refcnt is decremented
+  struct bucket *bk = bucket_for(b->dev, b->blockno);
+
+  acquire(&bk->lock);
+  if(b->refcnt > 1){
+    b->refcnt--;
+    release(&bk->lock);
+    return;
+  }
+  release(&bk->lock);
 
+  // probably the last reference. the lists need bcache.lock,
+  // which comes before the bucket lock, and must be held when
+  // refcnt reaches 0: bcache_shrink() could free the buffer
+  // the moment it's unused.
   acquire(&bcache.lock);
+  acquire(&bk->lock);
   b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  if(b->refcnt == 0){
+    if(b->hot){
+      list_remove(b);
+      list_push(b, 1);
+    }
+    if(bcache.nwaiting)
+      wake_up(&bcache.nwaiting);
   }
-  
+  release(&bk->lock);
   release(&bcache.lock);
 }
 
+// Release a locked buffer.
+void
+brelse(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("brelse");
+
+  releasesleep(&b->lock);
+  bput(b);
+}
+
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = bucket_for(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
+  bput(b);
+}
+
+// start reading the n blocks blocknos on dev into the cache,
+// those that aren't there already, and return without waiting
+// for the disk. each buffer stays locked until its read is done,
+// so a bread() of the block meanwhile waits for it. read-ahead
+// is only a hint, so a block is skipped if every buffer is in
+// use, and it stops where the disk has no room for more requests.
+// returns how many of the blocks it got through.
+int
+breadahead(uint dev, uint *blocknos, int n)
+{
+  struct buf *bufs[NAHEAD], *b;
+  int at[NAHEAD];
+  int i, nb, started;
+
+  for(i = 0; i < n; ){
+    // the next batch of blocks that aren't cached
+    for(nb = 0; i < n && nb < NAHEAD; i++){
+      if((b = bget(dev, blocknos[i], 1)) != 0){
+        at[nb] = i;
+        bufs[nb++] = b;
+      }
+    }
+    if(nb == 0)
+      break;
+    started = virtio_disk_start(bufs, nb, 0, breadahead_done);
+    for(int j = 0; j < started; j++)
+      rusage_blockread();
+    __atomic_fetch_add(&bcache.readahead, started, __ATOMIC_RELAXED);
+    if(started < nb){
+      // the rest stay in the cache, not valid, for bread() to read
+      for(int j = started; j < nb; j++){
+        releasesleep(&bufs[j]->lock);
+        bput(bufs[j]);
+      }
+      return at[started];
+    }
+  }
+  return n;
+}
+
+// the disk interrupt's report that a read breadahead()
+// started is done
+void
+breadahead_done(struct buf *b)
+{
+  b->valid = 1;
+  releasesleep(&b->lock);
+  bput(b);
+}
+
+// give the unused buffers beyond the first NBUF back to the
+// slab allocator, the in list's oldest first. kalloc() calls
+// this when it runs out of pages, before reclaiming empty slabs.
+// returns how many buffers were freed.
+int
+bcache_shrink(void)
+{
+  struct buf *b, *freed = 0;
+  int n = 0;
+
   acquire(&bcache.lock);
-  b->refcnt--;
+  for(int hot = 0; hot < 2; hot++){
+    while(bcache.nbuf > NBUF && (b = take_unused(hot, 0)) != 0){
+      b->hnext = freed;
+      freed = b;
+      bcache.nbuf--;
+    }
+  }
   release(&bcache.lock);
-}
 
+  while((b = freed) != 0){
+    freed = b->hnext;
+    kmem_cache_free(buf_cache, b);
+    n++;
+  }
+  return n;
+}
 
+// report buffer cache statistics for the bcachestat() system call
+void
+bcache_stats(struct bcachestat *st)
+{
+  st->hits = 0;
+  for(int i = 0; i < NBCACHEBUCKET; i++){
+    acquire(&bcache.buckets[i].lock);
+    st->hits += bcache.buckets[i].hits;
+    release(&bcache.buckets[i].lock);
+  }
+  acquire(&bcache.lock);
+  st->misses = bcache.misses;
+  st->ghosthits = bcache.ghosthits;
+  st->readahead = __atomic_load_n(&bcache.readahead, __ATOMIC_RELAXED);
+  st->nbuf = bcache.nbuf;
+  st->nhot = bcache.nbuf - bcache.nin;
+  release(&bcache.lock);
+}
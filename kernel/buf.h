@@ -7,6 +7,8 @@ struct buf {
   uint refcnt;
   struct buf *prev; // LRU cache list
   struct buf *next;
+  struct buf *hnext; // hash bucket chain (see bio.c)
+  int hot;     // on the hot list rather than the in list (see bio.c)
   uchar data[BSIZE];
 };
 
@@ -2,20 +2,30 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kmem_cache;
+struct kmemstat;
+struct cpustat;
+struct bcachestat;
 struct pipe;
 struct proc;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct vma;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwritev(struct buf**, int);
+int             breadahead(uint, uint*, int);
+void            breadahead_done(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bcache_shrink(void);
+void            bcache_stats(struct bcachestat*);
 
 // console.c
 void            console_init(void);
@@ -50,6 +60,7 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+uint            readahead(struct inode*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
@@ -63,6 +74,13 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kernel_free_page(void *);
 void            kernel_init_memory_allocator(void);
+void            kalloc_stats(struct kmemstat *);
+void*           kalloc_pages(int);
+void            kfree_pages(void *, int);
+void*           kalloc_zeroed(void);
+int             kalloc_zero_idle_page(void);
+void            kpage_ref(void *);
+int             kpage_refcount(void *);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -70,7 +88,18 @@ void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
 
+// mmap.c
+uint64          mmap(uint64, int, int, struct file*, uint64);
+int             munmap(uint64, uint64);
+uint64          mmap_base(struct proc*);
+struct vma*     mmap_lookup(struct proc*, uint64);
+int             mmap_fault(struct proc*, struct vma*, uint64, int);
+int             mmap_mkwrite(struct proc*, struct vma*, pte_t*);
+int             mmap_fork(struct proc*, struct proc*, int);
+void            mmap_unmap_all(struct proc*);
+
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -85,7 +114,10 @@ void            printf_init(void);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
-int             growproc(int);
+uint64          growproc(int);
+int             clone(uint64, uint64, uint64);
+int             join(int);
+void            tlb_shootdown(struct proc*);
 void            allocate_and_map_process_kernel_stacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
@@ -100,9 +132,19 @@ void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
-int             wait(uint64);
+int             wait(uint64, uint64);
 void            wake_up(void*);
 void            yield(void);
+int             set_affinity(uint);
+int             cpu_stats(struct cpustat*, int);
+void            rusage_blockread(void);
+int             getrusage(int, uint64);
+int             procinfo(uint64, int);
+void            make_runnable(struct proc*);
+void            sched_tick(void);
+#ifdef SCHED_MLFQ
+void            mlfq_boost(void);
+#endif
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
@@ -110,9 +152,16 @@ void            procdump(void);
 // swtch.S
 void            swtch(struct context*, struct context*);
 
+// slab.c
+struct kmem_cache* kmem_cache_create(char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+int             kmem_cache_reclaim(void);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
+int             holding_spinlocks(void);
 void            create_lock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
@@ -147,6 +196,24 @@ void            initialize_trap_system_globals(void);
 void            install_kernel_trap_vector_on_cpu(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
+void            update_ticks(void);
+uint64          tick_time(uint);
+void            timer_arm(int);
+
+// timer.c
+void            timer_wheel_init(void);
+int             sleep_until(uint64);
+void            timer_expire(void);
+uint64          timer_next_expiry(void);
+
+// trace.c
+void            trace_init(void);
+void            trace_record(int, int, uint64);
+
+// futex.c
+void            futex_init(void);
+int             futex_wait(uint64, int);
+int             futex_wake(uint64, int);
 
 // uart.c
 void            uart_init(void);
@@ -164,10 +231,21 @@ pagetable_t     uvmcreate(void);
 void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
-int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopy(pagetable_t, pagetable_t, uint64, int);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
+void            uvmunmap_user(struct proc*, uint64, uint64);
+int             uvminstall(struct proc*, uint64, char*, int);
+int             uvmunshare(struct proc*);
 void            uvmclear(pagetable_t, uint64);
+int             vmfault(pagetable_t, uint64, int);
+int             uvmcopyrange(pagetable_t, pagetable_t, uint64, uint64, int);
+void            uvmprefault(pagetable_t, uint64, uint64);
+void            uvmflush(pagetable_t);
+// uvmcopyrange() modes for writable pages
+#define UVM_COW    0  // share copy-on-write
+#define UVM_SHARE  1  // share outright
+#define UVM_COPY   2  // copy now
 pte_t *         walk_page_table(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
@@ -183,6 +261,8 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_rwv(struct buf **, int, int);
+int             virtio_disk_start(struct buf **, int, int, void (*)(struct buf *));
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
@@ -6,6 +6,7 @@
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
+#include "fs.h"
 
 static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
 
@@ -30,6 +31,18 @@ exec(char *path, char **argv)
   struct proghdr ph;
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
+  // segments are demand paged from the executable: record where each
+  // one lives in the file, and keep a reference to the inode
+  struct execseg segs[NEXECSEG];
+  int nsegs = 0;
+  struct inode *exec_ip = 0, *old_exec_ip;
+
+  // the new image replaces the whole address space, which
+  // other threads of the process would still be running in.
+  // so a process with threads can't exec(); and with none,
+  // p is its group leader.
+  if(p->group->nthreads > 1)
+    return -1;
 
   begin_op();
 
@@ -61,6 +74,20 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
+    if(ph.vaddr < PGROUNDUP(sz))
+      goto bad;
+    if(nsegs < NEXECSEG){
+      // nothing is read now; vmfault() pages it in on first touch
+      segs[nsegs].va = ph.vaddr;
+      segs[nsegs].memsz = ph.memsz;
+      segs[nsegs].filesz = ph.filesz;
+      segs[nsegs].off = ph.off;
+      segs[nsegs].perm = flags2perm(ph.flags);
+      nsegs++;
+      sz = ph.vaddr + ph.memsz;
+      continue;
+    }
+    // more segments than we track - load this one eagerly
     uint64 sz1;
     if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
       goto bad;
@@ -68,7 +95,9 @@ exec(char *path, char **argv)
     if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
       goto bad;
   }
-  iunlockput(ip);
+  // keep our reference to ip for the page fault handler
+  exec_ip = ip;
+  iunlock(ip);
   end_op();
   ip = 0;
 
@@ -121,12 +150,25 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  // mmap() regions belong to the old image.
+  mmap_unmap_all(p);
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
   p->sz = sz;
+  old_exec_ip = p->exec_ip;
+  p->exec_ip = exec_ip;
+  memmove(p->execseg, segs, sizeof(segs));
+  p->nexecseg = nsegs;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
+  // the old image's translations are still tagged with our asid
+  uvmflush(p->pagetable);
   proc_freepagetable(oldpagetable, oldsz);
+  if(old_exec_ip){
+    begin_op();
+    iput(old_exec_ip);
+    end_op();
+  }
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -137,6 +179,11 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  if(exec_ip){
+    begin_op();
+    iput(exec_ip);
+    end_op();
+  }
   return -1;
 }
 
@@ -147,7 +194,7 @@ exec(char *path, char **argv)
 static int
 loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
 {
-  uint i, n;
+  uint i, n, bn;
   uint64 pa;
 
   for(i = 0; i < sz; i += PGSIZE){
@@ -158,6 +205,10 @@ loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz
       n = sz - i;
     else
       n = PGSIZE;
+    // have the disk work on this page's blocks and the ones after
+    // it together, rather than one at a time in readi()
+    bn = (offset+i) / BSIZE;
+    readahead(ip, bn, (offset+i+n-1) / BSIZE - bn + 1 + NREADAHEAD);
     if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
       return -1;
   }
@@ -3,3 +3,14 @@
 #define O_RDWR    0x002
 #define O_CREATE  0x200
 #define O_TRUNC   0x400
+
+// mmap() protection
+#define PROT_NONE   0x0
+#define PROT_READ   0x1
+#define PROT_WRITE  0x2
+#define PROT_EXEC   0x4
+
+// mmap() flags
+#define MAP_SHARED     0x01  // stores go back to the file
+#define MAP_PRIVATE    0x02  // stores are private to the process
+#define MAP_ANONYMOUS  0x20  // zero-filled memory, no file
@@ -17,15 +17,20 @@
 // In Unix everything is a file
 // Treat devices as a file
 struct device_driver device_drivers[NDEV];
+// open files come from a slab cache; ftable.lock still protects
+// the reference counts and the system-wide NFILE limit.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  int nfile;                    // number of allocated files
 } ftable;
 
+static struct kmem_cache *file_cache;
+
 void
 fileinit(void)
 {
   create_lock(&ftable.lock, "ftable");
+  file_cache = kmem_cache_create("file", sizeof(struct file));
 }
 
 // Allocate a file structure.
@@ -35,15 +40,22 @@ filealloc(void)
   struct file *f;
 
   acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
+  if(ftable.nfile >= NFILE){
+    release(&ftable.lock);
+    return 0;
   }
+  ftable.nfile++;
   release(&ftable.lock);
-  return 0;
+
+  if((f = kmem_cache_alloc(file_cache)) == 0){
+    acquire(&ftable.lock);
+    ftable.nfile--;
+    release(&ftable.lock);
+    return 0;
+  }
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -72,9 +84,9 @@ fileclose(struct file *f)
     return;
   }
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
+  ftable.nfile--;
   release(&ftable.lock);
+  kmem_cache_free(file_cache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -114,6 +126,11 @@ fileread(struct file *f, uint64 addr, int n)
   if(f->readable == 0)
     return -1;
 
+  // pipes and devices copy out while holding a spinlock, so page
+  // in any of the buffer that would have to be read from a file
+  if(n > 0 && (f->type == FD_PIPE || f->type == FD_DEVICE))
+    uvmprefault(myproc()->pagetable, addr, n);
+
   if(f->type == FD_PIPE){
     r = piperead(f->pipe, addr, n);
   } else if(f->type == FD_DEVICE){
@@ -122,8 +139,21 @@ fileread(struct file *f, uint64 addr, int n)
     r = device_drivers[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
     ilock(f->ip);
+    // reading on from where the last read stopped: start this
+    // read's blocks and the NREADAHEAD after them on their way,
+    // so the disk works on them all at once. the file offset only
+    // moves forward, so blocks already started needn't be again.
+    if(n > 0 && f->off == f->seqoff){
+      uint bn = f->off / BSIZE;
+      uint last = (f->off + n - 1) / BSIZE + NREADAHEAD;
+      if(bn < f->ranext)
+        bn = f->ranext;
+      if(bn <= last)
+        f->ranext = readahead(f->ip, bn, last - bn + 1);
+    }
     if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
       f->off += r;
+    f->seqoff = f->off;
     iunlock(f->ip);
   } else {
     panic("fileread");
@@ -142,6 +172,10 @@ filewrite(struct file *f, uint64 addr, int n)
   if(f->writable == 0)
     return -1;
 
+  // see fileread()
+  if(n > 0 && (f->type == FD_PIPE || f->type == FD_DEVICE))
+    uvmprefault(myproc()->pagetable, addr, n);
+
   if(f->type == FD_PIPE){
     ret = pipewrite(f->pipe, addr, n);
   } else if(f->type == FD_DEVICE){
@@ -16,6 +16,8 @@ struct file {
   struct pipe *pipe;   // pipe structure (for FD_PIPE type)
   struct inode *ip;    // inode pointer (for FD_INODE and FD_DEVICE types)  
   uint off;           // current file offset/position (for FD_INODE type)
+  uint seqoff;        // where the last read ended; a read from here is sequential
+  uint ranext;        // first block read-ahead hasn't started yet
   short major;        // major device number (for FD_DEVICE type)
 };
 
@@ -57,3 +59,4 @@ extern struct device_driver device_drivers[];  // global device driver table
 
 // well-known device numbers
 #define CONSOLE 1  // major device number for console (terminal)
+#define TRACE   2  // major device number for the kernel event trace (see trace.c)
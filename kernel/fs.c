@@ -504,6 +504,36 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   return tot;
 }
 
+// Start reading up to n blocks of ip, from block bn on, into the
+// buffer cache without waiting for the disk, stopping at the end
+// of the file. Returns the first block not started, so the caller
+// can try the rest again once the disk has caught up.
+// Caller must hold ip->lock.
+uint
+readahead(struct inode *ip, uint bn, uint n)
+{
+  uint end = (ip->size + BSIZE - 1) / BSIZE;
+  uint addrs[16];
+  int k, done;
+
+  if(bn < end && end - bn > n)
+    end = bn + n;
+  while(bn < end){
+    // below the size, the blocks exist, so bmap() doesn't allocate
+    for(k = 0; k < NELEM(addrs) && bn + k < end; k++)
+      if((addrs[k] = bmap(ip, bn + k)) == 0)
+        break;
+    if(k == 0)
+      break;
+    // the disk gets them all at once
+    done = breadahead(ip->dev, addrs, k);
+    bn += done;
+    if(done < k)
+      break;
+  }
+  return bn;
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
@@ -662,10 +692,15 @@ namex(char *path, int nameiparent, char *name)
 {
   struct inode *ip, *next;
 
-  if(*path == '/')
+  if(*path == '/'){
     ip = iget(ROOTDEV, ROOTINO);
-  else
-    ip = idup(myproc()->cwd);
+  } else {
+    // another thread of the process may be in chdir()
+    struct proc *g = myproc()->group;
+    acquire(&g->group_lock);
+    ip = idup(g->cwd);
+    release(&g->group_lock);
+  }
 
   while((path = skipelem(path, name)) != 0){
     ilock(ip);
@@ -0,0 +1,121 @@
+// futexes: sleeping on a word of user memory
+//
+// user-space locks need a way to block until another thread changes a
+// word in memory they share, without spinning or using a pipe.
+// futex_wait(addr, val) sleeps if *addr is still val, and
+// futex_wake(addr, n) wakes up to n of the threads sleeping on addr:
+// - a futex is named by the page table and the user address, so the
+//   threads of one process (see clone()) share their futexes. processes
+//   sharing memory through mmap() do not.
+// - waiters are kept in a hash table of buckets, each a list with its
+//   own lock. a waiter's entry lives on its kernel stack while it's in
+//   sleep(), and is woken through its own channel, so a wake only
+//   touches the threads it's waking.
+// - futex_wait() checks *addr with the bucket lock held, and
+//   futex_wake() takes that lock, so a wake that follows a change to
+//   *addr can't fall between the check and the sleep.
+// the user library's mutexes and condition variables are built on these.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#define NFUTEXBUCKET 64
+
+struct futex_waiter {
+  pagetable_t pagetable;
+  uint64 uaddr;
+  int woken;                     // futex_wake() took us off the list
+  struct futex_waiter *next;
+};
+
+struct futex_bucket {
+  struct spinlock lock;
+  struct futex_waiter *head;
+};
+
+static struct futex_bucket futex_buckets[NFUTEXBUCKET];
+
+static struct futex_bucket *
+futex_bucket_for(pagetable_t pagetable, uint64 uaddr)
+{
+  return &futex_buckets[(((uint64)pagetable >> PGSHIFT) ^ (uaddr >> 2)) % NFUTEXBUCKET];
+}
+
+void
+futex_init(void)
+{
+  for(int i = 0; i < NFUTEXBUCKET; i++)
+    create_lock(&futex_buckets[i].lock, "futex");
+}
+
+// sleep until futex_wake() on uaddr, if the int at uaddr is val.
+// returns 0 once woken, or -1 at once if *uaddr isn't val (or
+// uaddr isn't a valid aligned address), or if the thread is killed.
+int
+futex_wait(uint64 uaddr, int val)
+{
+  struct proc *p = myproc();
+  struct futex_bucket *b = futex_bucket_for(p->pagetable, uaddr);
+  struct futex_waiter w, **pw;
+  int cur;
+
+  if(uaddr % sizeof(int) != 0)
+    return -1;
+  // the copyin() below runs with the bucket lock held, so it can't
+  // page the word in from a file
+  uvmprefault(p->pagetable, uaddr, sizeof(int));
+
+  acquire(&b->lock);
+  if(copyin(p->pagetable, (char*)&cur, uaddr, sizeof(cur)) < 0 || cur != val){
+    release(&b->lock);
+    return -1;
+  }
+  w.pagetable = p->pagetable;
+  w.uaddr = uaddr;
+  w.woken = 0;
+  w.next = b->head;
+  b->head = &w;
+
+  while(!w.woken){
+    if(killed(p)){
+      for(pw = &b->head; *pw != &w; pw = &(*pw)->next)
+        ;
+      *pw = w.next;
+      release(&b->lock);
+      return -1;
+    }
+    sleep(&w, &b->lock);
+  }
+  release(&b->lock);
+  return 0;
+}
+
+// wake up to n threads sleeping in futex_wait() on uaddr.
+// returns the number woken.
+int
+futex_wake(uint64 uaddr, int n)
+{
+  struct proc *p = myproc();
+  struct futex_bucket *b = futex_bucket_for(p->pagetable, uaddr);
+  struct futex_waiter *w, **pw;
+  int woken = 0;
+
+  acquire(&b->lock);
+  for(pw = &b->head; (w = *pw) != 0 && woken < n; ){
+    if(w->pagetable == p->pagetable && w->uaddr == uaddr){
+      *pw = w->next;
+      w->woken = 1;
+      wake_up(w);
+      woken++;
+    } else {
+      pw = &w->next;
+    }
+  }
+  release(&b->lock);
+  return woken;
+}
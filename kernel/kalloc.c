@@ -1,12 +1,26 @@
 // physical memory allocator, for user processes,
 // kernel stacks, page-table pages, and pipe buffers. 
-// allocates whole 4096-byte pages.
+// allocates whole 4096-byte pages, or physically contiguous
+// runs of 2^k pages via kalloc_pages(), checked at boot by
+// buddy_selftest().
 //
 // memory management fundamental concepts:
 // - physical memory is divided into 4096-byte pages
 // - kernel maintains a free list of available pages  
 // - kalloc() removes a page from free list and returns it
 // - kernel_free_page() adds a page back to the free list
+// - each cpu keeps a small cache of free pages so the common case
+//   doesn't need the global free list lock
+// - behind the caches, free memory is kept by a buddy allocator: free
+//   blocks of 2^order pages, split on allocation and merged with their
+//   "buddy" block on free, so contiguous runs can be found without scanning
+// - idle cpus pre-zero a small pool of pages, so kalloc_zeroed() callers
+//   (page tables, user memory) usually skip the memset
+// - every allocated page has a reference count, so copy-on-write fork can
+//   share a page between processes; kernel_free_page() drops a reference
+//   and the page is only really freed when the last one goes
+// - junk-filling pages on alloc/free to catch use-after-free is only done
+//   in KALLOC_DEBUG builds (make KALLOC_DEBUG=1)
 // - this is a simple but effective memory allocation strategy
 
 #include "types.h"
@@ -14,6 +28,7 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "riscv.h"
+#include "stat.h"
 #include "defs.h"
 
 void free_memory_range(void *memory_start, void *memory_end);
@@ -34,12 +49,66 @@ struct free_page_list_node {
   struct free_page_list_node *next_free_page; // pointer to next available page
 };
 
+// per-cpu free page cache ("magazine") sitting in front of the buddy allocator
+// kalloc()/kernel_free_page() normally only touch the calling cpu's cache, and
+// pages move between a cache and the buddy lists KMAG_BATCH at a time, so the
+// global physical_memory_lock is taken once per batch instead of once per page
+#define KMAG_BATCH  16               // pages moved per refill or drain
+#define KMAG_MAX    (2*KMAG_BATCH)   // drain a batch once a cache holds more than this
+
+#define ZEROED_POOL_MAX  64          // pre-zeroed pages kept ready for kalloc_zeroed()
+
+struct cpu_page_cache {
+  struct spinlock lock;                       // only contended when another cpu steals from us
+  struct free_page_list_node *free_pages;     // this cpu's private free list
+  int count;                                  // number of pages on free_pages
+};
+
+// buddy allocator bookkeeping
+// a free block of 2^order pages starting at page index i (counted from
+// KERNBASE) has a buddy at index i ^ 2^order; when both are free they
+// merge into one block of 2^(order+1) pages starting at the lower index.
+// the free lists are doubly linked through the free blocks themselves so
+// a buddy can be unlinked in O(1) when merging.
+#define BUDDY_MAX_ORDER  10                          // largest block is 2^10 pages (4MB)
+#define NPHYSPAGES       ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PA2PAGEINDEX(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define PAGEINDEX2PA(i)  ((void*)(KERNBASE + (uint64)(i) * PGSIZE))
+
+struct buddy_free_block {
+  struct buddy_free_block *next;
+  struct buddy_free_block *prev;
+};
+
 // global physical memory allocator state
 struct {
-  struct spinlock physical_memory_lock;   // protects free list from concurrent cpu access
-  struct free_page_list_node *free_page_list_head;  // head of linked list of available pages
+  struct spinlock physical_memory_lock;   // protects the buddy free lists from concurrent cpu access
+  struct buddy_free_block *free_area[BUDDY_MAX_ORDER+1];  // free blocks of each order
+  // order of the free block starting at each page, or -1 if no free block starts there
+  // (signed: plain char is unsigned on risc-v, so -1 would read back as 255)
+  signed char free_block_order[NPHYSPAGES];
+  uint64 free_page_count;                 // pages held by the buddy free lists
+  uint64 stolen_pages;                    // pages taken from another cpu's cache
+  struct cpu_page_cache cpu_cache[NCPU];  // one magazine per cpu, indexed by cpuid()
+  struct spinlock zeroed_lock;            // protects the pre-zeroed page pool
+  struct free_page_list_node *zeroed_pages; // free pages that are all zeros but the link
+  int zeroed_count;                       // number of pages on zeroed_pages
+  // references to each allocated page (page tables mapping it, plus the
+  // kernel's own); updated with atomic instructions, no lock needed
+  int page_refcount[NPHYSPAGES];
 } kernel_memory_allocator;
 
+static void buddy_insert(uint64 index, int order);
+static void buddy_remove(uint64 index, int order);
+static void buddy_free(uint64 index, int order);
+static int buddy_alloc(int order, uint64 *index);
+static struct free_page_list_node *take_free_page(void);
+static struct free_page_list_node *take_zeroed_page(void);
+static void refill_cpu_page_cache(struct cpu_page_cache *cache);
+static void drain_cpu_page_cache(struct cpu_page_cache *cache, int npages);
+static struct free_page_list_node *steal_page_from_other_cpus(int id);
+static void buddy_selftest(void);
+
 // initialize the physical memory allocator subsystem
 // called once during kernel startup to set up page allocation
 // sets up spinlock protection and populates initial free page pool
@@ -48,16 +117,24 @@ void kernel_init_memory_allocator() {
   // initialize spinlock to protect free page list from race conditions
   // multiple cpu cores may call kalloc/kernel_free_page simultaneously during operation
   create_lock(&kernel_memory_allocator.physical_memory_lock, "physical_memory_allocator");
+  for(int i = 0; i < NCPU; i++)
+    create_lock(&kernel_memory_allocator.cpu_cache[i].lock, "kmem_cpu_cache");
+  create_lock(&kernel_memory_allocator.zeroed_lock, "kmem_zeroed");
+  for(uint64 i = 0; i < NPHYSPAGES; i++)
+    kernel_memory_allocator.free_block_order[i] = -1;
   
   // populate free list with all available physical memory pages
   // memory from kernel_binary_end to PHYSTOP (physical memory limit) is available
   // this creates the initial pool of allocatable pages
   free_memory_range(kernel_binary_end, (void*)PHYSTOP);
+
+  buddy_selftest();
 }
 
-// add all pages in range [memory_start, memory_end) to free list
+// add all pages in range [memory_start, memory_end) to the buddy free lists
 // called during initialization to populate the initial free page pool
-// takes a contiguous block of physical memory and breaks it into 4kb pages
+// takes a contiguous block of physical memory and breaks it into 4kb pages,
+// which coalesce into the largest blocks their alignment allows
 // x
 void free_memory_range(void *memory_start, void *memory_end)
 {
@@ -68,17 +145,20 @@ void free_memory_range(void *memory_start, void *memory_end)
   current_page_address = (char*)PGROUNDUP((uint64)memory_start);
   
   // iterate through each 4kb page in the specified range
+  acquire(&kernel_memory_allocator.physical_memory_lock);
   for(; current_page_address + PGSIZE <= (char*)memory_end; current_page_address += PGSIZE)
-    kernel_free_page(current_page_address); // add this page to the free list
+    buddy_free(PA2PAGEINDEX(current_page_address), 0); // add this page to the free lists
+  release(&kernel_memory_allocator.physical_memory_lock);
 }
 
-// return a physical memory page to the free pool
+// drop a reference to a physical memory page, returning it to the free
+// pool when that was the last reference
 // accepts a page address that was previously allocated by kalloc()
-// (exception: during initialization, this is called on never-allocated pages)
 // x
 void kernel_free_page(void *page_address)
 {
   struct free_page_list_node *new_free_page_node;
+  int remaining_references;
 
   // comprehensive sanity checks to catch programming errors:
   // 1. page_address must be page-aligned (multiple of 4096 bytes)
@@ -89,23 +169,40 @@ void kernel_free_page(void *page_address)
      (uint64)page_address >= PHYSTOP)
     panic("kernel_free_page");
 
+  // page still shared with another page table (copy-on-write) - keep it
+  remaining_references = __atomic_sub_fetch(
+    &kernel_memory_allocator.page_refcount[PA2PAGEINDEX(page_address)], 1, __ATOMIC_ACQ_REL);
+  if(remaining_references < 0)
+    panic("kernel_free_page: not allocated");
+  if(remaining_references > 0)
+    return;
+
+#ifdef KALLOC_DEBUG
   // security feature - fill page with garbage to catch use-after-free bugs
   // if code accidentally tries to use freed memory, it gets junk instead of old data
   // this debugging technique helps catch dangling pointer vulnerabilities
   // preset the page to be filled with 1s
   memset(page_address, 1, PGSIZE);
+#endif
 
-  // prepare to add page to front of free list
+  // prepare to add page to front of this cpu's cache
   // treat the freed page itself as a free_page_list_node structure
   // free_page_list_node has only a pointer to the next page
   new_free_page_node = (struct free_page_list_node*)page_address;
 
-  // critical section - update free list atomically to prevent race conditions
-  // basically adding node to front of linked list, then updating head
-  acquire(&kernel_memory_allocator.physical_memory_lock);
-  new_free_page_node->next_free_page = kernel_memory_allocator.free_page_list_head; // point new node to current head
-  kernel_memory_allocator.free_page_list_head = new_free_page_node; // make new node the new head  
-  release(&kernel_memory_allocator.physical_memory_lock);
+  // interrupts stay off so we can't migrate to another cpu mid-way
+  push_off();
+  struct cpu_page_cache *cache = &kernel_memory_allocator.cpu_cache[cpuid()];
+  acquire(&cache->lock);
+  new_free_page_node->next_free_page = cache->free_pages;
+  cache->free_pages = new_free_page_node;
+  cache->count++;
+  // a cache that only ever frees (e.g. the cpu reaping exited processes) would
+  // otherwise hoard pages, so hand a batch back to the buddy allocator
+  if(cache->count > KMAG_MAX)
+    drain_cpu_page_cache(cache, KMAG_BATCH);
+  release(&cache->lock);
+  pop_off();
 }
  
 // allocate one 4096-byte page of physical memory from the free pool
@@ -116,18 +213,416 @@ void * kalloc(void)
 {
   struct free_page_list_node *allocated_page_node;
 
-  // critical section - atomically remove page from free list
-  // prevents race conditions when multiple cpus allocate simultaneously
-  acquire(&kernel_memory_allocator.physical_memory_lock);
-  allocated_page_node = kernel_memory_allocator.free_page_list_head;  // get current head of free list
+  allocated_page_node = take_free_page();
+
+  // the only free pages left may be ones idle cpus already zeroed
+  if(allocated_page_node == 0)
+    allocated_page_node = take_zeroed_page();
+
+  // out of pages - ask the slab caches to give back what they aren't using
+  // and try once more. unused disk buffers go back to their cache first,
+  // so whole pages of them can be reclaimed. both take locks the caller
+  // might hold, so only do it when the caller holds no spinlock
+  if(allocated_page_node == 0 && !holding_spinlocks()){
+    bcache_shrink();
+    if(kmem_cache_reclaim() > 0)
+      allocated_page_node = take_free_page();
+  }
+
   if(allocated_page_node)
-    kernel_memory_allocator.free_page_list_head = allocated_page_node->next_free_page; // advance head to next node
-  release(&kernel_memory_allocator.physical_memory_lock);
+    kernel_memory_allocator.page_refcount[PA2PAGEINDEX(allocated_page_node)] = 1;
 
+#ifdef KALLOC_DEBUG
   // security feature - fill allocated page with garbage to catch uninitialized read bugs
   // prevents information leakage and forces code to properly initialize memory
   // different pattern (5) than kernel_free_page (1) to help distinguish allocation vs free bugs
   if(allocated_page_node)
     memset((char*)allocated_page_node, 5, PGSIZE); 
+#endif
   return (void*)allocated_page_node;  // return pointer to allocated page (or null if out of memory)
 }
+
+// allocate one page filled with zeros
+// takes a page from the pre-zeroed pool when there is one, so the
+// caller doesn't pay for the memset; otherwise zeroes a fresh page
+// returns 0 if out of memory
+void * kalloc_zeroed(void)
+{
+  struct free_page_list_node *page = take_zeroed_page();
+
+  if(page){
+    kernel_memory_allocator.page_refcount[PA2PAGEINDEX(page)] = 1;
+    return (void*)page;
+  }
+  if((page = kalloc()) != 0)
+    memset(page, 0, PGSIZE);
+  return (void*)page;
+}
+
+// add a reference to a page returned by kalloc(), for sharing it
+// copy-on-write between page tables; kernel_free_page() drops it again
+void kpage_ref(void *page_address)
+{
+  if(__atomic_add_fetch(&kernel_memory_allocator.page_refcount[PA2PAGEINDEX(page_address)],
+                        1, __ATOMIC_ACQ_REL) < 2)
+    panic("kpage_ref");
+}
+
+// number of references to an allocated page
+int kpage_refcount(void *page_address)
+{
+  return __atomic_load_n(&kernel_memory_allocator.page_refcount[PA2PAGEINDEX(page_address)],
+                         __ATOMIC_ACQUIRE);
+}
+
+// zero one free page and add it to the pre-zeroed pool
+// called by the scheduler when this cpu has nothing to run
+// returns 1 if a page was zeroed, 0 if the pool is full or memory is short
+int kalloc_zero_idle_page(void)
+{
+  struct free_page_list_node *page;
+
+  // racy read - an occasional extra page or skipped round is harmless
+  if(kernel_memory_allocator.zeroed_count >= ZEROED_POOL_MAX)
+    return 0;
+  if((page = take_free_page()) == 0)
+    return 0;
+
+  memset(page, 0, PGSIZE);
+
+  acquire(&kernel_memory_allocator.zeroed_lock);
+  page->next_free_page = kernel_memory_allocator.zeroed_pages;
+  kernel_memory_allocator.zeroed_pages = page;
+  kernel_memory_allocator.zeroed_count++;
+  release(&kernel_memory_allocator.zeroed_lock);
+  return 1;
+}
+
+// pop a page from the pre-zeroed pool, or return 0 if it is empty
+// the link word is cleared so the whole page is zero
+static struct free_page_list_node *take_zeroed_page(void)
+{
+  struct free_page_list_node *page;
+
+  acquire(&kernel_memory_allocator.zeroed_lock);
+  page = kernel_memory_allocator.zeroed_pages;
+  if(page){
+    kernel_memory_allocator.zeroed_pages = page->next_free_page;
+    kernel_memory_allocator.zeroed_count--;
+  }
+  release(&kernel_memory_allocator.zeroed_lock);
+
+  if(page)
+    page->next_free_page = 0;
+  return page;
+}
+
+// pop a page from this cpu's cache, the buddy allocator, or another cpu's cache
+// returns 0 if there are no free pages anywhere
+static struct free_page_list_node *take_free_page(void)
+{
+  struct free_page_list_node *allocated_page_node;
+
+  // fast path - pop from this cpu's cache, refilling it from the buddy
+  // allocator in one batch when it runs dry
+  push_off();
+  int id = cpuid();
+  struct cpu_page_cache *cache = &kernel_memory_allocator.cpu_cache[id];
+  acquire(&cache->lock);
+  if(cache->count == 0)
+    refill_cpu_page_cache(cache);
+  allocated_page_node = cache->free_pages;
+  if(allocated_page_node){
+    cache->free_pages = allocated_page_node->next_free_page;
+    cache->count--;
+  }
+  release(&cache->lock);
+
+  // buddy allocator is empty too - the remaining free pages are sitting
+  // in other cpus' caches
+  if(allocated_page_node == 0)
+    allocated_page_node = steal_page_from_other_cpus(id);
+  pop_off();
+
+  return allocated_page_node;
+}
+
+// move up to KMAG_BATCH single pages from the buddy allocator into cache
+// caller holds cache->lock (lock order: cpu cache, then global lock)
+static void refill_cpu_page_cache(struct cpu_page_cache *cache)
+{
+  struct free_page_list_node *page;
+  uint64 index;
+
+  acquire(&kernel_memory_allocator.physical_memory_lock);
+  for(int i = 0; i < KMAG_BATCH; i++){
+    if(buddy_alloc(0, &index) < 0)
+      break;
+    page = (struct free_page_list_node*)PAGEINDEX2PA(index);
+    page->next_free_page = cache->free_pages;
+    cache->free_pages = page;
+    cache->count++;
+  }
+  release(&kernel_memory_allocator.physical_memory_lock);
+}
+
+// give npages pages from cache back to the buddy allocator
+// caller holds cache->lock
+static void drain_cpu_page_cache(struct cpu_page_cache *cache, int npages)
+{
+  struct free_page_list_node *page;
+
+  acquire(&kernel_memory_allocator.physical_memory_lock);
+  for(int i = 0; i < npages && cache->free_pages; i++){
+    page = cache->free_pages;
+    cache->free_pages = page->next_free_page;
+    cache->count--;
+    buddy_free(PA2PAGEINDEX(page), 0);
+  }
+  release(&kernel_memory_allocator.physical_memory_lock);
+}
+
+// take half of the first non-empty cache found on another cpu, keep one page
+// for the caller and stash the rest in this cpu's cache
+// called with interrupts off and no cache lock held: holding our own lock
+// while taking another cpu's would deadlock against that cpu stealing from us
+static struct free_page_list_node *steal_page_from_other_cpus(int id)
+{
+  struct free_page_list_node *stolen = 0, *page;
+  int nstolen = 0;
+
+  for(int i = 1; i < NCPU && stolen == 0; i++){
+    struct cpu_page_cache *victim = &kernel_memory_allocator.cpu_cache[(id + i) % NCPU];
+    acquire(&victim->lock);
+    int take = (victim->count + 1) / 2;
+    for(; nstolen < take; nstolen++){
+      page = victim->free_pages;
+      victim->free_pages = page->next_free_page;
+      victim->count--;
+      page->next_free_page = stolen;
+      stolen = page;
+    }
+    release(&victim->lock);
+  }
+  if(stolen == 0)
+    return 0;
+
+  struct cpu_page_cache *cache = &kernel_memory_allocator.cpu_cache[id];
+  acquire(&cache->lock);
+  // other cpus steal at the same time, under their own cache locks
+  __atomic_fetch_add(&kernel_memory_allocator.stolen_pages, nstolen, __ATOMIC_RELAXED);
+  page = stolen;
+  stolen = stolen->next_free_page;
+  while(stolen){
+    struct free_page_list_node *next = stolen->next_free_page;
+    stolen->next_free_page = cache->free_pages;
+    cache->free_pages = stolen;
+    cache->count++;
+    stolen = next;
+  }
+  release(&cache->lock);
+  return page;
+}
+
+// allocate 2^order physically contiguous pages, aligned to their size
+// returns 0 if no block that large is free
+void * kalloc_pages(int order)
+{
+  uint64 index;
+  int r;
+
+  if(order < 0 || order > BUDDY_MAX_ORDER)
+    panic("kalloc_pages: order");
+  if(order == 0)
+    return kalloc();
+
+  acquire(&kernel_memory_allocator.physical_memory_lock);
+  r = buddy_alloc(order, &index);
+  release(&kernel_memory_allocator.physical_memory_lock);
+
+  if(r < 0){
+    // pages parked in cpu caches may be the buddies that would complete a
+    // big enough block - return them all and try once more
+    for(int i = 0; i < NCPU; i++){
+      struct cpu_page_cache *cache = &kernel_memory_allocator.cpu_cache[i];
+      acquire(&cache->lock);
+      drain_cpu_page_cache(cache, cache->count);
+      release(&cache->lock);
+    }
+    acquire(&kernel_memory_allocator.physical_memory_lock);
+    r = buddy_alloc(order, &index);
+    release(&kernel_memory_allocator.physical_memory_lock);
+    if(r < 0)
+      return 0;
+  }
+
+#ifdef KALLOC_DEBUG
+  memset(PAGEINDEX2PA(index), 5, PGSIZE << order); // junk, as in kalloc()
+#endif
+  return PAGEINDEX2PA(index);
+}
+
+// free a block returned by kalloc_pages(order)
+void kfree_pages(void *pa, int order)
+{
+  if(order < 0 || order > BUDDY_MAX_ORDER ||
+     ((uint64)pa % (PGSIZE << order)) != 0 ||
+     (char*)pa < kernel_binary_end ||
+     (uint64)pa + (PGSIZE << order) > PHYSTOP)
+    panic("kfree_pages");
+  if(order == 0){
+    kernel_free_page(pa);
+    return;
+  }
+
+#ifdef KALLOC_DEBUG
+  memset(pa, 1, PGSIZE << order); // junk, as in kernel_free_page()
+#endif
+
+  acquire(&kernel_memory_allocator.physical_memory_lock);
+  buddy_free(PA2PAGEINDEX(pa), order);
+  release(&kernel_memory_allocator.physical_memory_lock);
+}
+
+// put the free block at index on the order free list
+// caller holds physical_memory_lock
+static void buddy_insert(uint64 index, int order)
+{
+  struct buddy_free_block *block = (struct buddy_free_block*)PAGEINDEX2PA(index);
+
+  block->prev = 0;
+  block->next = kernel_memory_allocator.free_area[order];
+  if(block->next)
+    block->next->prev = block;
+  kernel_memory_allocator.free_area[order] = block;
+  kernel_memory_allocator.free_block_order[index] = order;
+}
+
+// take the free block at index off the order free list
+// caller holds physical_memory_lock
+static void buddy_remove(uint64 index, int order)
+{
+  struct buddy_free_block *block = (struct buddy_free_block*)PAGEINDEX2PA(index);
+
+  if(block->prev)
+    block->prev->next = block->next;
+  else
+    kernel_memory_allocator.free_area[order] = block->next;
+  if(block->next)
+    block->next->prev = block->prev;
+  kernel_memory_allocator.free_block_order[index] = -1;
+}
+
+// free the 2^order page block at index, merging it with its buddy
+// for as long as the buddy is also a whole free block
+// caller holds physical_memory_lock
+static void buddy_free(uint64 index, int order)
+{
+  kernel_memory_allocator.free_page_count += 1L << order;
+  while(order < BUDDY_MAX_ORDER){
+    uint64 buddy = index ^ (1L << order);
+    // pages below kernel_binary_end are never freed, so a buddy that
+    // overlaps the kernel image never merges
+    if(buddy >= NPHYSPAGES || kernel_memory_allocator.free_block_order[buddy] != order)
+      break;
+    buddy_remove(buddy, order);
+    if(buddy < index)
+      index = buddy;
+    order++;
+  }
+  buddy_insert(index, order);
+}
+
+// allocate a 2^order page block, splitting a larger free block if
+// needed; the unused halves go back on the lower-order free lists
+// returns 0 and sets *index on success, -1 if nothing big enough is free
+// caller holds physical_memory_lock
+static int buddy_alloc(int order, uint64 *index)
+{
+  int k;
+
+  for(k = order; k <= BUDDY_MAX_ORDER; k++)
+    if(kernel_memory_allocator.free_area[k])
+      break;
+  if(k > BUDDY_MAX_ORDER)
+    return -1;
+
+  uint64 i = PA2PAGEINDEX(kernel_memory_allocator.free_area[k]);
+  buddy_remove(i, k);
+  while(k > order){
+    k--;
+    buddy_insert(i + (1L << k), k);
+  }
+  kernel_memory_allocator.free_page_count -= 1L << order;
+  *index = i;
+  return 0;
+}
+
+// count the free blocks of each order
+static void buddy_count(int *n)
+{
+  acquire(&kernel_memory_allocator.physical_memory_lock);
+  for(int k = 0; k <= BUDDY_MAX_ORDER; k++){
+    n[k] = 0;
+    for(struct buddy_free_block *b = kernel_memory_allocator.free_area[k]; b; b = b->next)
+      n[k]++;
+  }
+  release(&kernel_memory_allocator.physical_memory_lock);
+}
+
+// check at boot that kalloc_pages() splits blocks into aligned, disjoint
+// pieces of the right size, and that kfree_pages() merges them back into
+// exactly the free blocks there were before, whatever order they're freed in
+// only blocks of order 1 and up: order 0 goes through the per-cpu caches,
+// which keep some of what they're given
+static void buddy_selftest(void)
+{
+  static int orders[] = { 3, 1, 5, 1, 2, 4, 1, 3, 2, 1, 6, 2 };
+  enum { N = sizeof(orders) / sizeof(orders[0]) };
+  int before[BUDDY_MAX_ORDER+1], after[BUDDY_MAX_ORDER+1];
+  uint64 free0 = kernel_memory_allocator.free_page_count;
+  char *blocks[N];
+
+  buddy_count(before);
+  for(int i = 0; i < N; i++){
+    if((blocks[i] = kalloc_pages(orders[i])) == 0)
+      panic("buddy_selftest: alloc");
+    if((uint64)blocks[i] % (PGSIZE << orders[i]) != 0)
+      panic("buddy_selftest: alignment");
+    memset(blocks[i], i, PGSIZE << orders[i]);
+  }
+  // a block overlapping another would have had some of it overwritten
+  for(int i = 0; i < N; i++)
+    for(uint64 j = 0; j < (PGSIZE << orders[i]); j += PGSIZE)
+      if(blocks[i][j] != i)
+        panic("buddy_selftest: overlap");
+
+  // free the odd ones first, so merges have to wait for the even ones
+  for(int i = 1; i < N; i += 2)
+    kfree_pages(blocks[i], orders[i]);
+  for(int i = 0; i < N; i += 2)
+    kfree_pages(blocks[i], orders[i]);
+
+  buddy_count(after);
+  for(int k = 0; k <= BUDDY_MAX_ORDER; k++)
+    if(after[k] != before[k])
+      panic("buddy_selftest: blocks not merged back");
+  if(kernel_memory_allocator.free_page_count != free0)
+    panic("buddy_selftest: free count");
+}
+
+// report allocator statistics for the kmemstat() system call
+void kalloc_stats(struct kmemstat *st)
+{
+  acquire(&kernel_memory_allocator.physical_memory_lock);
+  st->free_pages = kernel_memory_allocator.free_page_count;
+  st->global_acquires = kernel_memory_allocator.physical_memory_lock.nacquire;
+  st->global_contended = kernel_memory_allocator.physical_memory_lock.ncontended;
+  release(&kernel_memory_allocator.physical_memory_lock);
+
+  // cache counts are read without their locks - a snapshot is good enough
+  st->steals = __atomic_load_n(&kernel_memory_allocator.stolen_pages, __ATOMIC_RELAXED);
+  for(int i = 0; i < NCPU; i++)
+    st->free_pages += kernel_memory_allocator.cpu_cache[i].count;
+  st->free_pages += kernel_memory_allocator.zeroed_count;
+}
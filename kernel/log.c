@@ -28,7 +28,8 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// Log appends are synchronous, but the blocks of a commit go
+// to the disk LOGBATCH at a time, all in flight at once.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
@@ -48,6 +49,10 @@ struct log {
 };
 struct log log;
 
+// blocks written to the disk at once by a commit. each holds a
+// buffer beyond the pinned ones, so keep it well under NBUF.
+#define LOGBATCH 8
+
 static void recover_from_log(void);
 static void commit();
 
@@ -68,17 +73,27 @@ initlog(int dev, struct superblock *sb)
 static void
 install_trans(int recovering)
 {
-  int tail;
-
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  struct buf *dbuf[LOGBATCH];
+  int tail, i, n;
+
+  for (tail = 0; tail < log.lh.n; tail += n) {
+    n = log.lh.n - tail < LOGBATCH ? log.lh.n - tail : LOGBATCH;
+    for (i = 0; i < n; i++) {
+      dbuf[i] = bread(log.dev, log.lh.block[tail+i]); // read dst
+      if(recovering){
+        // after a crash, the log on disk is the only copy. otherwise
+        // the pinned dst in the cache already holds what was logged.
+        struct buf *lbuf = bread(log.dev, log.start+tail+i+1); // read log block
+        memmove(dbuf[i]->data, lbuf->data, BSIZE);  // copy block to dst
+        brelse(lbuf);
+      }
+    }
+    bwritev(dbuf, n);  // write dsts to disk
+    for (i = 0; i < n; i++) {
+      if(recovering == 0)
+        bunpin(dbuf[i]);
+      brelse(dbuf[i]);
+    }
   }
 }
 
@@ -178,15 +193,20 @@ end_op(void)
 static void
 write_log(void)
 {
-  int tail;
-
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  struct buf *to[LOGBATCH];
+  int tail, i, n;
+
+  for (tail = 0; tail < log.lh.n; tail += n) {
+    n = log.lh.n - tail < LOGBATCH ? log.lh.n - tail : LOGBATCH;
+    for (i = 0; i < n; i++) {
+      to[i] = bread(log.dev, log.start+tail+i+1); // log block
+      struct buf *from = bread(log.dev, log.lh.block[tail+i]); // cache block
+      memmove(to[i]->data, from->data, BSIZE);
+      brelse(from);
+    }
+    bwritev(to, n);  // write the log
+    for (i = 0; i < n; i++)
+      brelse(to[i]);
   }
 }
 
@@ -47,6 +47,18 @@ void main() {
         // trap/interrupt handling initialization
         // initializes global trap system locks and data structures
         initialize_trap_system_globals();      
+
+        // timer wheel initialization
+        // sets up the wheel that sleep() and nanosleep() file sleeping processes on
+        timer_wheel_init();
+
+        // futex initialization
+        // sets up the hash table of threads sleeping in futex_wait()
+        futex_init();
+
+        // event tracing initialization
+        // sets up the per-cpu trace rings and the trace device
+        trace_init();
         
         // install kernel trap vector for this cpu
         // loads the kernel trap handler address into the stvec register
@@ -78,6 +90,10 @@ void main() {
         // fileinit() initializes the system-wide file table
         // this tracks all open files across all processes
         fileinit();      
+
+        // pipe allocator initialization
+        // pipeinit() creates the slab cache that struct pipes come from
+        pipeinit();
         
         // storage device initialization
         // virtio_disk_init() initializes the emulated virtio disk device
@@ -32,6 +32,10 @@
 //             this is where qemu loads our kernel
 //             after 0x80000000 is unused RAM that the kernel can allocate
 
+// qemu's time csr, which stimecmp compares against, counts at 10MHz
+#define TIMEBASE_FREQ 10000000L
+#define NSEC_PER_CYCLE (1000000000L / TIMEBASE_FREQ)
+
 // the kernel uses physical memory thus:
 // 80000000 -- entry.S, then kernel text and data
 //             kernel code starts here and grows upward
@@ -90,6 +94,17 @@
 //   fixed-size stack      - grows downward from high address
 //   expandable heap       - grows upward, allocated by malloc
 //   ...
+//   mmap regions          - placed downward from MMAPTOP
+//   THREADFRAMEs - trapframes of the threads made by clone()
 //   TRAPFRAME   - saved registers when entering kernel
 //   TRAMPOLINE  - code for entering/exiting kernel
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+
+// threads share their group's page table, so each needs its trapframe
+// at an address of its own; a proc slot's is only used while the slot
+// holds a thread
+#define THREADFRAME(p) (TRAPFRAME - ((p)+1)*PGSIZE)
+
+// mmap() regions are placed top-down below this address,
+// with an unmapped guard page between them and the lowest THREADFRAME
+#define MMAPTOP (THREADFRAME(NPROC-1) - PGSIZE)
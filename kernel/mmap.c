@@ -0,0 +1,328 @@
+// memory-mapped files and anonymous memory
+//
+// mmap() only records a region (struct vma) in the process; nothing is
+// read or allocated until the process touches a page, when vmfault()
+// calls mmap_fault():
+// - anonymous regions get a zeroed page
+// - file regions get a page read from the inode at the matching offset
+//   (bytes past end of file read as zero), straight into the user page
+//   rather than through a read() buffer
+// - MAP_PRIVATE pages are the process's own; fork() shares them
+//   copy-on-write like ordinary memory
+// - MAP_SHARED file pages are mapped read-only at first and made writable
+//   (and marked PTE_D) on the first store, so munmap()/exit() only write
+//   back pages that were actually modified. fork() shares them outright.
+//   there is no page cache, so separate mmap()s of one file don't see each
+//   other's stores until they are written back.
+// a process's threads share its mappings, kept in the group leader and
+// changed under its group_lock.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
+#include "defs.h"
+
+static void mmap_writeback(struct proc *p, struct vma *v, uint64 start, uint64 end);
+
+// lowest address used by p's mappings; the heap must stay below it
+uint64
+mmap_base(struct proc *p)
+{
+  struct proc *g = p->group;
+  uint64 base = MMAPTOP;
+
+  for(int i = 0; i < NVMA; i++)
+    if(g->vmas[i].used && g->vmas[i].start < base)
+      base = g->vmas[i].start;
+  return base;
+}
+
+// the mapping of p containing va, or 0
+struct vma *
+mmap_lookup(struct proc *p, uint64 va)
+{
+  for(int i = 0; i < NVMA; i++){
+    struct vma *v = &p->group->vmas[i];
+    if(v->used && va >= v->start && va < v->start + v->len)
+      return v;
+  }
+  return 0;
+}
+
+// map len bytes of f from offset off (or anonymous memory if f is 0)
+// into the current process, just below its lowest existing mapping.
+// returns the address of the mapping, or -1.
+uint64
+mmap(uint64 len, int prot, int flags, struct file *f, uint64 off)
+{
+  struct proc *p = myproc();
+  struct proc *g = p->group;
+  struct vma *v = 0;
+  uint64 start;
+  int shared = (flags & MAP_SHARED) != 0;
+
+  // a len near 2^64 would round up to 0
+  if(len == 0 || len > MMAPTOP || off % PGSIZE != 0 ||
+     shared == ((flags & MAP_PRIVATE) != 0))
+    return -1;
+  if(f){
+    if(f->type != FD_INODE)
+      return -1;
+    // every page is read from the file when first touched,
+    // whatever prot says
+    if(!f->readable)
+      return -1;
+    // stores to a shared mapping end up in the file
+    if(shared && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+  }
+
+  len = PGROUNDUP(len);
+  acquire(&g->group_lock);
+  for(int i = 0; i < NVMA; i++){
+    if(!g->vmas[i].used){
+      v = &g->vmas[i];
+      break;
+    }
+  }
+  uint64 base = mmap_base(p);
+  if(v == 0 || len > base || base - len < PGROUNDUP(g->sz)){
+    release(&g->group_lock);
+    return -1;
+  }
+
+  v->start = base - len;
+  v->len = len;
+  v->prot = prot;
+  v->flags = flags;
+  v->file = f ? filedup(f) : 0;
+  v->off = off;
+  v->used = 1;
+  // once the lock is dropped another thread may munmap() the
+  // slot and reuse it
+  start = v->start;
+  release(&g->group_lock);
+  return start;
+}
+
+// remove [addr, addr+len) from the current process's mappings,
+// writing modified MAP_SHARED pages back to the file first.
+// the range must be page-aligned and cover the start or the end
+// (or all) of a single mapping.
+// returns 0 on success, -1 on error.
+int
+munmap(uint64 addr, uint64 len)
+{
+  struct proc *p = myproc();
+  struct proc *g = p->group;
+  struct vma *v, old;
+  struct file *closef = 0;
+
+  if(addr % PGSIZE != 0 || len == 0 || len > MMAPTOP)
+    return -1;
+  len = PGROUNDUP(len);
+  acquire(&g->group_lock);
+  if((v = mmap_lookup(p, addr)) == 0 || addr + len > v->start + v->len ||
+     (addr != v->start && addr + len != v->start + v->len)){
+    // not mapped, or would split the mapping in two
+    release(&g->group_lock);
+    return -1;
+  }
+  old = *v;
+  release(&g->group_lock);
+
+  // writing back sleeps, so it's done with the range still mapped
+  if(old.file && (old.flags & MAP_SHARED))
+    mmap_writeback(p, &old, addr, addr + len);
+
+  // take the range out of the mapping before unmapping the pages, so
+  // that another thread's fault can't map them again. if another
+  // thread got there first, the range isn't ours to unmap any more.
+  acquire(&g->group_lock);
+  if(v->used && v->start == old.start && v->len == old.len){
+    if(addr == v->start){
+      v->start += len;
+      v->off += len;
+    }
+    v->len -= len;
+    if(v->len == 0){
+      closef = v->file;
+      v->file = 0;
+      v->used = 0;
+    }
+  } else {
+    len = 0;
+  }
+  release(&g->group_lock);
+
+  if(len == 0)
+    return -1;
+  uvmunmap_user(p, addr, len / PGSIZE);
+  if(closef)
+    fileclose(closef);
+  return 0;
+}
+
+// unmap all of the current process p's mappings, for exit()
+// and exec(), once p is its only thread
+void
+mmap_unmap_all(struct proc *p)
+{
+  for(int i = 0; i < NVMA; i++)
+    if(p->vmas[i].used)
+      munmap(p->vmas[i].start, p->vmas[i].len);
+}
+
+// give child np copies of p's mappings, for fork().
+// pages p has already faulted in are shared with np:
+// outright for MAP_SHARED, and for MAP_PRIVATE as
+// private says (UVM_COW, or UVM_COPY if p has threads).
+// caller holds p->group->group_lock.
+// returns 0 on success, -1 on failure (np's mappings are
+// then left empty).
+int
+mmap_fork(struct proc *p, struct proc *np, int private)
+{
+  int i;
+
+  for(i = 0; i < NVMA; i++){
+    struct vma *v = &p->group->vmas[i];
+    if(!v->used)
+      continue;
+    if(uvmcopyrange(p->pagetable, np->pagetable, v->start, v->start + v->len,
+                    (v->flags & MAP_SHARED) ? UVM_SHARE : private) < 0)
+      goto bad;
+    np->vmas[i] = *v;
+    if(v->file)
+      filedup(v->file);
+  }
+  return 0;
+
+ bad:
+  // the page tables are freed by the caller; just drop what we took
+  for(int j = 0; j < i; j++){
+    struct vma *v = &np->vmas[j];
+    if(!v->used)
+      continue;
+    uvmunmap(np->pagetable, v->start, v->len / PGSIZE, 1);
+    if(v->file)
+      fileclose(v->file);
+    v->used = 0;
+    v->file = 0;
+  }
+  return -1;
+}
+
+// handle a fault at unmapped va in mapping v of the current
+// process p. access is PTE_R, PTE_W or PTE_X, as for vmfault().
+// maps a fresh page, read from the file for a file mapping.
+// returns 0 if handled, -1 if the access isn't allowed.
+int
+mmap_fault(struct proc *p, struct vma *v, uint64 va, int access)
+{
+  char *mem;
+  int perm = PTE_U;
+
+  va = PGROUNDDOWN(va);
+  if(access == PTE_W && !(v->prot & PROT_WRITE))
+    return -1;
+  if(access == PTE_R && !(v->prot & (PROT_READ|PROT_WRITE)))
+    return -1;
+  if(access == PTE_X && !(v->prot & PROT_EXEC))
+    return -1;
+
+  if((mem = kalloc_zeroed()) == 0)
+    return -1;
+
+  if(v->file){
+    struct inode *ip = v->file->ip;
+    // reading the inode sleeps; and if this fault came from
+    // copying to/from this very file, we'd deadlock on its lock
+    if(holding_spinlocks() || holdingsleep(&ip->lock)){
+      kernel_free_page(mem);
+      return -1;
+    }
+    ilock(ip);
+    uint64 off = v->off + (va - v->start);
+    if(off < ip->size){
+      uint n = ip->size - off < PGSIZE ? ip->size - off : PGSIZE;
+      if(readi(ip, 0, (uint64)mem, off, n) != n){
+        iunlock(ip);
+        kernel_free_page(mem);
+        return -1;
+      }
+    }
+    iunlock(ip);
+  }
+
+  // RISC-V reserves PTE_W without PTE_R, so writable implies readable
+  if(v->prot & (PROT_READ|PROT_WRITE))
+    perm |= PTE_R;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+  if(v->prot & PROT_WRITE){
+    // shared file pages stay read-only until stored to, so that
+    // PTE_D says which ones need writing back
+    if(!(v->file && (v->flags & MAP_SHARED)))
+      perm |= PTE_W;
+    else if(access == PTE_W)
+      perm |= PTE_W | PTE_D;
+  }
+  if((perm & (PTE_R|PTE_W|PTE_X)) == 0)
+    perm |= PTE_R;  // a leaf needs some permission
+
+  return uvminstall(p, va, mem, perm);
+}
+
+// handle a store fault at read-only PTE pte in mapping v of the
+// current process p: the first store to a MAP_SHARED page makes
+// it writable and dirty.
+// caller holds p->group->group_lock.
+// returns 0 if handled, -1 if the access isn't allowed.
+int
+mmap_mkwrite(struct proc *p, struct vma *v, pte_t *pte)
+{
+  if(!(v->prot & PROT_WRITE) || (v->flags & MAP_PRIVATE))
+    return -1;
+  *pte |= PTE_W | PTE_D;
+  uvmflush(p->pagetable);
+  return 0;
+}
+
+// write the modified pages of MAP_SHARED mapping v in [start, end)
+// back to its file. never extends the file.
+static void
+mmap_writeback(struct proc *p, struct vma *v, uint64 start, uint64 end)
+{
+  struct inode *ip = v->file->ip;
+  // a page takes a few log transactions, as in filewrite()
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  pte_t *pte;
+
+  for(uint64 a = start; a < end; a += PGSIZE){
+    pte = walk_page_table(p->pagetable, a, 0);
+    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_D) == 0)
+      continue;
+    uint64 pa = PTE2PA(*pte);
+    uint64 off = v->off + (a - v->start);
+    for(int i = 0; i < PGSIZE; i += max){
+      int n = PGSIZE - i < max ? PGSIZE - i : max;
+      begin_op();
+      ilock(ip);
+      if(off + i < ip->size){
+        if(off + i + n > ip->size)
+          n = ip->size - (off + i);
+        writei(ip, 0, pa + i, off + i, n);
+      }
+      iunlock(ip);
+      end_op();
+    }
+  }
+}
@@ -35,11 +35,29 @@
                          // ensures atomic operations don't consume too much log space
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
                                       // crash recovery log for atomic file operations  
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-                                      // how many disk blocks to cache in memory
+#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache at boot
+                                      // it never shrinks below this many blocks
+#define NBUF_MAX     1024  // most disk blocks the cache grows to
+                           // three buffers fit in a page, so about 1.4MB at most
+#define NBCACHEBUCKET 257  // buffer cache hash buckets: a prime near NBUF_MAX/4,
+                           // so a full cache has chains of about 4
+#define NREADAHEAD   8     // blocks read ahead of a sequential reader
 #define FSSIZE       2000  // size of file system in blocks (each block = 1KB)
                           // total storage capacity of the file system
 
+// timer
+#define TICK_CYCLES   1000000  // time csr cycles per tick (sleep(), uptime()), about 1/10 s
+#define QUANTUM_CYCLES TICK_CYCLES // default time slice before a cpu's timer preempts
+
+// scheduling - make SCHED_MLFQ=1 builds the multi-level feedback
+// queue scheduler instead of plain round-robin
+#ifdef SCHED_MLFQ
+#define NSCHEDLEVEL   3    // priority levels, 0 is highest
+#define MLFQ_BOOST_TICKS 10 // move every process back to level 0 this often
+#else
+#define NSCHEDLEVEL   1    // round-robin is a single level
+#endif
+
 // user program limits
 #define USERSTACK    1     // user stack pages (4KB per page)
                           // how much stack space user programs get
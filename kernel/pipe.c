@@ -19,6 +19,16 @@ struct pipe {
   int writeopen;  // write fd is still open
 };
 
+// pipes come from a slab cache - a struct pipe is ~600 bytes,
+// so several fit in the page each used to take
+static struct kmem_cache *pipe_cache;
+
+void
+pipeinit(void)
+{
+  pipe_cache = kmem_cache_create("pipe", sizeof(struct pipe));
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,7 +38,7 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = (struct pipe*)kmem_cache_alloc(pipe_cache)) == 0)
     goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
@@ -47,7 +57,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kernel_free_page((char*)pi);
+    kmem_cache_free(pipe_cache, pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -68,7 +78,7 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kernel_free_page((char*)pi);
+    kmem_cache_free(pipe_cache, pi);
   } else
     release(&pi->lock);
 }
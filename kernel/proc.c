@@ -4,6 +4,9 @@
 // - the kernel maintains arrays of struct proc and struct cpu
 // - processes are allocated from the proc[] array as needed
 // - each cpu core tracks which process it's currently running
+// - RUNNABLE processes wait on a per-cpu run queue, so picking the next
+//   process doesn't depend on NPROC; idle cpus steal from busy ones
+// - a process may be limited to some of the cpus (see set_affinity())
 // - context switching allows rapid switching between processes
 // - process IDs (PIDs) are unique identifiers assigned sequentially
 
@@ -13,6 +16,8 @@
 #include "riscv.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "stat.h"
+#include "trace.h"
 #include "defs.h"
 
 // global arrays for all cpus and processes in the system
@@ -30,6 +35,71 @@ static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
 
+// per-cpu run queues of RUNNABLE processes, in FIFO order.
+// a process goes back on the queue of the cpu it last ran on, which
+// keeps its caches warm; a cpu whose queue is empty steals from the
+// others before going idle.
+// each queue has one list per priority level (just one level unless
+// built with SCHED_MLFQ), and the highest non-empty level runs first.
+// a process whose affinity leaves out a cpu is never queued there, nor
+// stolen by it.
+// lock order: p->lock, then the run queue lock. so the scheduler takes
+// a process off a queue first and only then locks it; that's safe
+// because only the scheduler that dequeued it moves it out of RUNNABLE.
+struct runqueue {
+  struct spinlock lock;
+  struct proc *head[NSCHEDLEVEL];  // next process to run at each level
+  struct proc *tail[NSCHEDLEVEL];
+  int n;                     // number of queued processes, all levels
+  int npinned;               // ...of which have a restricted affinity
+};
+static struct runqueue runqueues[NCPU];
+
+// bit per cpu that has started its scheduler
+static uint cpus_online;
+// number of processes whose affinity is restricted (not ~0)
+static int sched_pinned;
+
+#ifdef SCHED_MLFQ
+// multi-level feedback queue: a process starts at level 0 and drops a
+// level each time it uses up the time slice of its current level, so
+// cpu-bound processes sink while ones that mostly sleep stay on top
+// and get the cpu as soon as they wake. ticks used count across
+// sleeps, so sleeping just before the slice ends doesn't keep a
+// process on top. every MLFQ_BOOST_TICKS everything goes back to level
+// 0, so sunk processes can't starve.
+static const int mlfq_slice[NSCHEDLEVEL] = { 1, 2, 4 };  // in quanta (timer interrupts)
+#endif
+
+// processes sleeping on a channel, hashed by the channel's address so
+// wake_up() doesn't have to look at every process.
+// lock order: wait queue lock, then p->lock.
+#define NWAITQUEUE 64
+struct waitqueue {
+  struct spinlock lock;
+  struct proc *head;         // sleepers on channels that hash here, via wq_next
+};
+static struct waitqueue waitqueues[NWAITQUEUE];
+
+static struct waitqueue *
+waitqueue_for(void *chan)
+{
+  uint64 a = (uint64)chan;
+  return &waitqueues[((a >> 3) ^ (a >> 12)) % NWAITQUEUE];
+}
+
+static void runqueue_push(struct proc *p);
+static struct proc *runqueue_pop(struct runqueue *rq, int cpu);
+static struct proc *runqueue_steal(int thief);
+#ifdef SCHED_MLFQ
+static int runqueue_has_above(struct runqueue *rq, int level);
+#endif
+static void idle(struct cpu *c);
+static void kill_locked(struct proc *p);
+static void affinity_set(struct proc *p, uint mask);
+static void usage_add(struct usage *dst, struct usage *src);
+static void usage_out(struct rusage *ru, struct usage *u);
+
 // helps ensure that wake_ups of wait()ing parents are not lost
 // helps obey the memory model when using p->parent
 // must be acquired before any p->lock
@@ -71,10 +141,15 @@ void initialize_process_table(void)
   // initialize locks for process management
   create_lock(&pid_lock, "nextpid"); // protects pid allocation - of typedef spinlock
   create_lock(&wait_lock, "wait_lock"); // coordinates parent/child relationships - of typedef spinlock
+  for(int i = 0; i < NCPU; i++)
+    create_lock(&runqueues[i].lock, "runqueue");
+  for(int i = 0; i < NWAITQUEUE; i++)
+    create_lock(&waitqueues[i].lock, "waitqueue");
   
   // initialize each process slot in the process table
   for(p = proc; p < &proc[NPROC]; p++) {
       create_lock(&p->lock, "proc"); // create a lock for future use that protects individual process fields
+      create_lock(&p->group_lock, "group"); // protects the state shared by the threads p leads
       p->state = UNUSED; // mark slot as available
       p->kstack = KSTACK((int) (p - proc)); // remember kernel stack virtual address
   }
@@ -125,8 +200,10 @@ int allocpid()
 // look in the process table for an UNUSED proc
 // if found, initialize state required to run in the kernel,
 // and return with p->lock held
+// the proc is a new process if group is 0, or else a new thread
+// in group's address space (see clone())
 // if there are no free procs, or a memory allocation fails, return 0
-static struct proc* allocproc(void)
+static struct proc* allocproc(struct proc *group)
 {
   struct proc *p;
 
@@ -145,6 +222,12 @@ found:
   // initialize the new process
   p->pid = allocpid();  // assign unique process ID
   p->state = USED;      // mark as allocated but not yet runnable
+  p->cpu = cpuid();     // first queued on the creating cpu (interrupts are off: we hold p->lock)
+  p->lastcpu = -1;
+  p->affinity = ~0U;    // any cpu; fork() and clone() pass on the creator's
+  p->priority = 0;      // new processes start at the top level
+  p->ticks_used = 0;
+  p->user_seq = 0;
 
   // allocate a trapframe page - holds saved user registers
   // this page will be mapped in user virtual address space
@@ -154,15 +237,41 @@ found:
     return 0;
   }
 
-  // create an empty user page table for this process
-  // each process gets its own virtual address space
-  p->pagetable = proc_pagetable(p);
-  if(p->pagetable == 0){
-    freeproc(p);
-    release(&p->lock);
-    return 0;
+  if(group == 0){
+    // create an empty user page table for this process
+    // each process gets its own virtual address space
+    p->group = p;
+    p->nthreads = 1;
+    p->trapframe_va = TRAPFRAME;
+    p->pagetable = proc_pagetable(p);
+    if(p->pagetable == 0){
+      freeproc(p);
+      release(&p->lock);
+      return 0;
+    }
+  } else {
+    // a thread shares group's page table, and has its trapframe
+    // mapped in it at an address of its own
+    int r;
+    p->group = group;
+    p->trapframe_va = THREADFRAME(p - proc);
+    acquire(&group->group_lock);
+    r = create_page_table_mappings(group->pagetable, p->trapframe_va, PGSIZE,
+                                   (uint64)p->trapframe, PTE_R | PTE_W);
+    release(&group->group_lock);
+    if(r < 0){
+      freeproc(p);
+      release(&p->lock);
+      return 0;
+    }
+    p->pagetable = group->pagetable;
   }
 
+  // each slot has its own asid; the slot's previous owner may have
+  // left entries in any cpu's TLB under it
+  p->asid = (p - proc) + 1;
+  p->tlb_stale = ~0;
+
   // set up new context to start executing at forkret,
   // which will return to user space
   memset(&p->context, 0, sizeof(p->context));
@@ -173,7 +282,9 @@ found:
 }
 
 // free a proc structure and the data hanging from it,
-// including user pages.
+// including user pages. a thread's page table belongs to
+// its group leader, and exit() already unmapped its
+// trapframe from it.
 // p->lock must be held.
 static void
 freeproc(struct proc *p)
@@ -181,12 +292,19 @@ freeproc(struct proc *p)
   if(p->trapframe)
     kernel_free_page((void*)p->trapframe);
   p->trapframe = 0;
-  if(p->pagetable)
+  if(p->pagetable && p->group == p)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
   p->sz = 0;
   p->pid = 0;
   p->parent = 0;
+  p->group = 0;
+  p->nthreads = 0;
+  p->trapframe_va = 0;
+  affinity_set(p, ~0U);
+  memset(&p->ru, 0, sizeof(p->ru));
+  memset(&p->tru, 0, sizeof(p->tru));
+  memset(&p->cru, 0, sizeof(p->cru));
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
@@ -257,7 +375,7 @@ userinit(void)
 {
   struct proc *p;
 
-  p = allocproc();
+  p = allocproc(0);
   initproc = p;
   
   // allocate one user page and copy initcode's instructions
@@ -272,52 +390,117 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  make_runnable(p);
 
   release(&p->lock);
 }
 
+// memory from sz up is gone: cut g's exec segments down to it, so
+// a fault there after the process grows again maps a zeroed page
+// rather than one from the executable. caller holds g->group_lock.
+static void
+execseg_trim(struct proc *g, uint64 sz)
+{
+  int i, n = 0;
+
+  for(i = 0; i < g->nexecseg; i++){
+    struct execseg *seg = &g->execseg[i];
+    if(seg->va >= sz)
+      continue;
+    if(seg->memsz > sz - seg->va)
+      seg->memsz = sz - seg->va;
+    if(seg->filesz > seg->memsz)
+      seg->filesz = seg->memsz;
+    g->execseg[n++] = *seg;
+  }
+  g->nexecseg = n;
+}
+
 // Grow or shrink user memory by n bytes.
-// Return 0 on success, -1 on failure.
-int
+// Return the old size, or -1 on failure.
+uint64
 growproc(int n)
 {
-  uint64 sz;
+  uint64 sz, oldsz;
   struct proc *p = myproc();
+  struct proc *g = p->group;
 
-  sz = p->sz;
+  acquire(&g->group_lock);
+  oldsz = sz = g->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    // lazy allocation: only reserve the address range here;
+    // vmfault() maps a zeroed page when each one is first touched
+    if(sz + n < sz || sz + n > mmap_base(p)){
+      release(&g->group_lock);
       return -1;
     }
-  } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    sz += n;
+  } else if(n < 0 && sz + n < sz){
+    sz += n;
+    execseg_trim(g, sz);
   }
-  p->sz = sz;
-  return 0;
+  g->sz = sz;
+  release(&g->group_lock);
+
+  if(PGROUNDUP(sz) < PGROUNDUP(oldsz))
+    uvmunmap_user(p, PGROUNDUP(sz), (PGROUNDUP(oldsz) - PGROUNDUP(sz)) / PGSIZE);
+  return oldsz;
 }
 
 // Create a new process, copying the parent.
 // Sets up child kernel stack to return as if from fork() system call.
+// The child gets a copy of the whole process, but only of the
+// calling thread.
 int
 fork(void)
 {
-  int i, pid;
+  int i, pid, mode;
   struct proc *np;
   struct proc *p = myproc();
+  struct proc *g = p->group;
 
   // Allocate process.
-  if((np = allocproc()) == 0){
+  if((np = allocproc(0)) == 0){
+    return -1;
+  }
+
+  // other threads may be changing the memory, mappings and
+  // descriptors being copied
+  acquire(&g->group_lock);
+
+  // Copy user memory from parent to child. Copy-on-write would
+  // make the parent's pages read-only under its other threads'
+  // feet (see uvmunshare()), so with threads the child gets its
+  // own copies at once.
+  mode = g->nthreads > 1 ? UVM_COPY : UVM_COW;
+  if(uvmcopy(p->pagetable, np->pagetable, g->sz, mode) < 0){
+    release(&g->group_lock);
+    freeproc(np);
+    release(&np->lock);
     return -1;
   }
+  np->sz = g->sz;
 
-  // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  // and the mmap() regions (the parent keeps its file references,
+  // so backing out on failure never drops the last one here)
+  if(mmap_fork(p, np, mode) < 0){
+    release(&g->group_lock);
     freeproc(np);
     release(&np->lock);
     return -1;
   }
-  np->sz = p->sz;
+
+  // increment reference counts on open file descriptors.
+  for(i = 0; i < NOFILE; i++)
+    if(g->ofile[i])
+      np->ofile[i] = filedup(g->ofile[i]);
+  np->cwd = idup(g->cwd);
+  // pages the parent never faulted in come from the same executable
+  if(g->exec_ip)
+    np->exec_ip = idup(g->exec_ip);
+  memmove(np->execseg, g->execseg, sizeof(g->execseg));
+  np->nexecseg = g->nexecseg;
+  release(&g->group_lock);
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -325,29 +508,176 @@ fork(void)
   // Cause fork to return 0 in the child.
   np->trapframe->a0 = 0;
 
-  // increment reference counts on open file descriptors.
-  for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
-  np->cwd = idup(p->cwd);
-
   safestrcpy(np->name, p->name, sizeof(p->name));
+  affinity_set(np, p->affinity);
 
   pid = np->pid;
 
   release(&np->lock);
 
   acquire(&wait_lock);
-  np->parent = p;
+  np->parent = g;
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  make_runnable(np);
   release(&np->lock);
 
   return pid;
 }
 
+// Create a new thread in the current process: it shares the page
+// table, open files, current directory and mmap() regions, has its
+// own trapframe and kernel stack, and starts in user space at fn(arg)
+// with its stack pointer at stack. fn must end with exit(), not return.
+// Returns the new thread's id (a pid of its own), or -1.
+int
+clone(uint64 fn, uint64 arg, uint64 stack)
+{
+  int tid;
+  struct proc *np;
+  struct proc *p = myproc();
+  struct proc *g = p->group;
+
+  // nothing may stay copy-on-write once there's a second thread.
+  // while there's one, nobody else can change nthreads.
+  if(g->nthreads == 1 && uvmunshare(p) < 0)
+    return -1;
+
+  if((np = allocproc(g)) == 0)
+    return -1;
+
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->sp = stack;
+  np->trapframe->a0 = arg;
+
+  safestrcpy(np->name, p->name, sizeof(p->name));
+  affinity_set(np, p->affinity);
+
+  tid = np->pid;
+
+  release(&np->lock);
+
+  acquire(&g->group_lock);
+  g->nthreads++;
+  release(&g->group_lock);
+
+  acquire(&np->lock);
+  make_runnable(np);
+  release(&np->lock);
+
+  return tid;
+}
+
+// Wait for the thread tid of the current process (any thread, if
+// tid is 0) to exit, and free it.
+// Return its id, or -1 if there is no such thread. A process's first
+// thread can't be waited for: when it exits, so does the process.
+int
+join(int tid)
+{
+  struct proc *pp;
+  int found;
+  struct proc *p = myproc();
+  struct proc *g = p->group;
+
+  acquire(&wait_lock);
+
+  for(;;){
+    found = 0;
+    for(pp = proc; pp < &proc[NPROC]; pp++){
+      if(pp == p || pp == g)
+        continue;
+      // the slot may be in allocproc() or freeproc(); pp->lock
+      // keeps its group steady
+      acquire(&pp->lock);
+      if(pp->group == g && (tid == 0 || pp->pid == tid)){
+        found = 1;
+        if(pp->state == ZOMBIE){
+          tid = pp->pid;
+          usage_add(&g->tru, &pp->ru);
+          freeproc(pp);
+          release(&pp->lock);
+          release(&wait_lock);
+          return tid;
+        }
+      }
+      release(&pp->lock);
+    }
+
+    if(!found || killed(p)){
+      release(&wait_lock);
+      return -1;
+    }
+
+    // exiting threads wake their leader
+    sleep(g, &wait_lock);
+  }
+}
+
+// Wait until none of p's other threads can still be using a TLB
+// entry from before a change to their shared page table.
+// uvmflush() has marked them all stale, so each flushes on its way
+// back to user space; only those in user space right now have to be
+// waited for, until their next trap. there are no inter-processor
+// interrupts to hurry them along, so that can take up to a quantum.
+// must not be called with a spinlock held.
+void
+tlb_shootdown(struct proc *p)
+{
+  struct proc *t;
+  uint64 seq;
+
+  if(p->group->nthreads == 1)
+    return;
+  for(t = proc; t < &proc[NPROC]; t++){
+    if(t == p || t->pagetable != p->pagetable)
+      continue;
+    seq = __atomic_load_n(&t->user_seq, __ATOMIC_SEQ_CST);
+    while((seq & 1) && __atomic_load_n(&t->user_seq, __ATOMIC_SEQ_CST) == seq)
+      yield();
+  }
+}
+
+// Kill the other threads of group leader g and wait for them to
+// exit, freeing each one; for exit(), before g tears down the state
+// they share.
+static void
+reap_threads(struct proc *g)
+{
+  struct proc *t;
+  int found, live;
+
+  acquire(&wait_lock);
+  for(;;){
+    // a dying thread may still be making a new one, so only a pass
+    // that finds no threads at all means they're all gone
+    found = live = 0;
+    for(t = proc; t < &proc[NPROC]; t++){
+      if(t == g)
+        continue;
+      acquire(&t->lock);
+      if(t->group == g){
+        found = 1;
+        if(t->state == ZOMBIE){
+          usage_add(&g->tru, &t->ru);
+          freeproc(t);
+        } else {
+          kill_locked(t);
+          live = 1;
+        }
+      }
+      release(&t->lock);
+    }
+    if(!found)
+      break;
+    if(live)
+      sleep(g, &wait_lock);
+  }
+  release(&wait_lock);
+}
+
 // Pass p's abandoned children to init.
 // Caller must hold wait_lock.
 void
@@ -363,38 +693,66 @@ reparent(struct proc *p)
   }
 }
 
-// Exit the current process.  Does not return.
-// An exited process remains in the zombie state
-// until its parent calls wait().
+// Exit the current thread.  Does not return.
+// An exited thread remains in the zombie state until
+// its parent calls wait(), or for a thread made by
+// clone(), until another thread of its process calls
+// join(). The first thread of a process exiting ends
+// the whole process.
 void
 exit(int status)
 {
   struct proc *p = myproc();
+  struct proc *g = p->group;
 
   if(p == initproc)
     panic("init exiting");
 
-  // Close all open files.
-  for(int fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd]){
-      struct file *f = p->ofile[fd];
-      fileclose(f);
-      p->ofile[fd] = 0;
+  if(p == g){
+    // the other threads go first: the rest tears down
+    // what they share
+    reap_threads(p);
+
+    // Write back and drop mmap() regions, while their files are still open.
+    mmap_unmap_all(p);
+
+    // Close all open files.
+    for(int fd = 0; fd < NOFILE; fd++){
+      if(p->ofile[fd]){
+        struct file *f = p->ofile[fd];
+        fileclose(f);
+        p->ofile[fd] = 0;
+      }
     }
-  }
 
-  begin_op();
-  iput(p->cwd);
-  end_op();
-  p->cwd = 0;
+    begin_op();
+    iput(p->cwd);
+    if(p->exec_ip)
+      iput(p->exec_ip);
+    end_op();
+    p->cwd = 0;
+    p->exec_ip = 0;
+    p->nexecseg = 0;
+  } else {
+    // a thread only has its trapframe mapping to give back
+    acquire(&g->group_lock);
+    uvmunmap(p->pagetable, p->trapframe_va, 1, 0);
+    g->nthreads--;
+    release(&g->group_lock);
+  }
 
   acquire(&wait_lock);
 
-  // Give any children to init.
-  reparent(p);
+  if(p == g){
+    // Give any children to init.
+    reparent(p);
 
-  // Parent might be sleeping in wait().
-  wake_up(p->parent);
+    // Parent might be sleeping in wait().
+    wake_up(p->parent);
+  } else {
+    // join(), or the leader's exit(), waits on the leader.
+    wake_up(g);
+  }
   
   acquire(&p->lock);
 
@@ -411,11 +769,21 @@ exit(int status)
 // Wait for a child process to exit and return its pid.
 // Return -1 if this process has no children.
 int
-wait(uint64 addr)
+wait(uint64 addr, uint64 ruaddr)
 {
   struct proc *pp;
   int havekids, pid;
   struct proc *p = myproc();
+  struct proc *g = p->group;
+  struct usage u;
+  struct rusage ru;
+
+  // copyout() below runs with spinlocks held, so it can't page the
+  // status variable in from the executable - do that now
+  if(addr != 0)
+    uvmprefault(p->pagetable, addr, sizeof(int));
+  if(ruaddr != 0)
+    uvmprefault(p->pagetable, ruaddr, sizeof(ru));
 
   acquire(&wait_lock);
 
@@ -423,7 +791,8 @@ wait(uint64 addr)
     // Scan through table looking for exited children.
     havekids = 0;
     for(pp = proc; pp < &proc[NPROC]; pp++){
-      if(pp->parent == p){
+      // children belong to the whole process
+      if(pp->parent == g){
         // make sure the child isn't still in exit() or swtch().
         acquire(&pp->lock);
 
@@ -431,12 +800,20 @@ wait(uint64 addr)
         if(pp->state == ZOMBIE){
           // Found one.
           pid = pp->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
-                                  sizeof(pp->xstate)) < 0) {
+          // the child's usage, with its threads' and children's
+          u = pp->ru;
+          usage_add(&u, &pp->tru);
+          usage_add(&u, &pp->cru);
+          usage_out(&ru, &u);
+          if((addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
+                                   sizeof(pp->xstate)) < 0) ||
+             (ruaddr != 0 && copyout(p->pagetable, ruaddr, (char *)&ru,
+                                     sizeof(ru)) < 0)) {
             release(&pp->lock);
             release(&wait_lock);
             return -1;
           }
+          usage_add(&g->cru, &u);
           freeproc(pp);
           release(&pp->lock);
           release(&wait_lock);
@@ -453,14 +830,15 @@ wait(uint64 addr)
     }
     
     // Wait for a child to exit.
-    sleep(p, &wait_lock);  //DOC: wait-sleep
+    sleep(g, &wait_lock);  //DOC: wait-sleep
   }
 }
 
 // per-cpu core process scheduler - the heart of multitasking
 // each cpu core calls scheduler() after initialization and never returns
 // implements time-sharing by continuously switching between processes:
-//  1. scan process table for runnable processes (round-robin selection)
+//  1. take the next process off this cpu's run queue (round-robin order),
+//     or steal one from another cpu's queue if ours is empty
 //  2. context switch to chosen process and let it run
 //  3. when process yields/blocks, switch back to scheduler and repeat
 //
@@ -470,8 +848,10 @@ void scheduler(void)
 {
   struct proc *candidate_process;
   struct cpu *current_cpu_core = mycpu();
+  int id = current_cpu_core - cpus;  // the scheduler thread never changes cpu
 
   current_cpu_core->proc = 0;  // initialize: no process currently running on this cpu
+  __atomic_fetch_or(&cpus_online, 1U << id, __ATOMIC_RELAXED);
   
   // infinite scheduling loop - scheduler runs forever
   for(;;){
@@ -482,45 +862,297 @@ void scheduler(void)
 
     int found_runnable_process = 0;  // flag to track if we found any work to do
     
-    // scan entire process table searching for runnable processes
-    // simple round-robin algorithm: fair but not optimal for performance
-    // more sophisticated schedulers consider priorities, deadlines, cpu affinity
-    for(candidate_process = proc; candidate_process < &proc[NPROC]; candidate_process++) {
+    // the run queues only hold RUNNABLE processes, so this costs the same
+    // however many processes exist
+    if((candidate_process = runqueue_pop(&runqueues[id], id)) == 0 &&
+       (candidate_process = runqueue_steal(id)) != 0)
+      current_cpu_core->steals++;
+
+    if(candidate_process) {
       acquire(&candidate_process->lock);  // protect process state from concurrent cpu access
-      
-      if(candidate_process->state == RUNNABLE) {
-        // found a process ready to execute!
+      if(candidate_process->state != RUNNABLE)
+        panic("scheduler: queued process not runnable");
         
-        // transition process from ready queue to running state
-        // the process is responsible for releasing its lock during execution
-        // and reacquiring it when yielding back to scheduler  
-        candidate_process->state = RUNNING;  // mark process as actively executing
-        current_cpu_core->proc = candidate_process;         // record which process this cpu is running
+      // transition process from ready queue to running state
+      // the process is responsible for releasing its lock during execution
+      // and reacquiring it when yielding back to scheduler  
+      candidate_process->state = RUNNING;  // mark process as actively executing
+      candidate_process->cpu = id;         // and requeue it here when it's runnable again
+      current_cpu_core->proc = candidate_process;         // record which process this cpu is running
+      current_cpu_core->nswitch++;
+      if(candidate_process->lastcpu != id && candidate_process->lastcpu >= 0)
+        current_cpu_core->migrations++;
+      candidate_process->lastcpu = id;
+      trace_record(TRACE_RUN, candidate_process->pid, 0);
+      candidate_process->ru.nswitch++;
+      candidate_process->run_start = r_time();
+
+      // give the process a full quantum (the timer may be off if this cpu was idle)
+      timer_arm(0);
         
-        // perform the critical context switch operation!
-        // 1. save scheduler's cpu registers (stack pointer, etc.) in current_cpu_core->context
-        // 2. load process's saved registers from candidate_process->context
-        // 3. execution jumps to wherever the process last yielded/was preempted
-        swtch(&current_cpu_core->context, &candidate_process->context);
-
-        // execution returns here when process yields back to scheduler
-        // the process has either:
-        // - voluntarily yielded (sleep, wait, exit)
-        // - been preempted by timer interrupt 
-        // - completed its time slice
-        current_cpu_core->proc = 0;  // clear cpu's current process pointer
-        found_runnable_process = 1;    // record that we successfully ran a process
-      }
+      // perform the critical context switch operation!
+      // 1. save scheduler's cpu registers (stack pointer, etc.) in current_cpu_core->context
+      // 2. load process's saved registers from candidate_process->context
+      // 3. execution jumps to wherever the process last yielded/was preempted
+      swtch(&current_cpu_core->context, &candidate_process->context);
+
+      // execution returns here when process yields back to scheduler
+      // the process has either:
+      // - voluntarily yielded (sleep, wait, exit)
+      // - been preempted by timer interrupt 
+      // - completed its time slice
+      current_cpu_core->proc = 0;  // clear cpu's current process pointer
+      candidate_process->ru.cputime += r_time() - candidate_process->run_start;
+      trace_record(TRACE_STOP, candidate_process->pid, 0);
+      found_runnable_process = 1;    // record that we successfully ran a process
       release(&candidate_process->lock);
     }
     
     // handle case where no processes are currently runnable
     // all processes may be sleeping/waiting for i/o, user input, or other events
     // use wait-for-interrupt to save power until something becomes ready
-    if(found_runnable_process == 0) {
-      intr_on();          // ensure interrupts are enabled to wake sleeping processes
-      asm volatile("wfi"); // wait for interrupt (low power mode)
+    // before sleeping, use the idle time to pre-zero a page for kalloc_zeroed();
+    // one page per pass so a newly runnable process isn't kept waiting
+    if(found_runnable_process == 0 && kalloc_zero_idle_page() == 0)
+      idle(current_cpu_core);
+  }
+}
+
+// wait for an interrupt with nothing to run.
+// if no cpu is running anything the timer is turned off (tickless idle)
+// until the next sleep() deadline: nothing can become runnable except
+// through an interrupt, and device interrupts and the deadline wake
+// every idle cpu. while other cpus are busy, an idle cpu keeps its
+// timer going so it can steal the processes they make runnable. so it
+// does while any process has a restricted affinity: such a process may
+// be queued on an idle cpu by another that can't run it, and there is
+// no way to interrupt the idle one but its own timer.
+// interrupts stay off around wfi, which still wakes up when one is
+// pending; they're taken when the scheduler turns them back on. so an
+// interrupt that makes a process runnable can't slip in before the wfi
+// and leave it waiting for the next one.
+static void idle(struct cpu *c)
+{
+  struct runqueue *rq = &runqueues[c - cpus];
+  int busy = 0;
+
+  intr_off();
+
+  // from here on make_runnable() won't queue processes on this cpu,
+  // which might not wake up for a long time. it checks c->idle with
+  // the queue lock held, so nothing can have slipped in behind this.
+  acquire(&rq->lock);
+  if(rq->n == 0)
+    c->idle = 1;
+  release(&rq->lock);
+  if(c->idle == 0)
+    return;
+
+  for(int i = 0; i < NCPU; i++){
+    // processes with a restricted affinity may not be ours to steal;
+    // they are picked up on the next timer interrupt
+    if(__atomic_load_n(&runqueues[i].n, __ATOMIC_RELAXED) !=
+       __atomic_load_n(&runqueues[i].npinned, __ATOMIC_RELAXED)){
+      c->idle = 0;  // something to steal
+      return;
+    }
+    if(__atomic_load_n(&cpus[i].proc, __ATOMIC_RELAXED) != 0)
+      busy = 1;
+  }
+  if(__atomic_load_n(&sched_pinned, __ATOMIC_RELAXED) != 0)
+    busy = 1;
+
+  timer_arm(!busy);
+  asm volatile("wfi"); // wait for interrupt (low power mode)
+  c->idle = 0;
+}
+
+// mark p RUNNABLE and queue it on the run queue of the cpu it last ran on
+// caller must hold p->lock
+void make_runnable(struct proc *p)
+{
+  p->state = RUNNABLE;
+  trace_record(TRACE_RUNNABLE, p->pid, 0);
+  runqueue_push(p);
+}
+
+// append p to the tail of its level on its cpu's run queue, or on this
+// cpu's if that one is idle (see idle()) and p may run here.
+// if p may no longer run on its cpu (it has just called set_affinity()),
+// it goes to the allowed cpu with the shortest queue.
+// caller holds p->lock
+static void runqueue_push(struct proc *p)
+{
+  struct runqueue *rq;
+  int level = p->priority;
+  int me = cpuid();  // interrupts are off: we hold p->lock
+
+  if((p->affinity & (1U << p->cpu)) == 0){
+    int best = -1;
+    for(int i = 0; i < NCPU; i++)
+      if((p->affinity & cpus_online & (1U << i)) &&
+         (best < 0 || runqueues[i].n < runqueues[best].n))
+        best = i;
+    p->cpu = best;
+  }
+
+  rq = &runqueues[p->cpu];
+  acquire(&rq->lock);
+  if(cpus[p->cpu].idle && (p->affinity & (1U << me))){
+    release(&rq->lock);
+    p->cpu = me;
+    rq = &runqueues[p->cpu];
+    acquire(&rq->lock);
+  }
+  p->rq_next = 0;
+  if(rq->tail[level])
+    rq->tail[level]->rq_next = p;
+  else
+    rq->head[level] = p;
+  rq->tail[level] = p;
+  rq->n++;
+  if(p->affinity != ~0U)
+    rq->npinned++;
+  release(&rq->lock);
+}
+
+// remove and return the first process of the highest non-empty level
+// of rq that may run on cpu, or 0 if there's none.
+// the processes on a cpu's own queue may all run there, so only a
+// steal has to look past the first one.
+static struct proc *runqueue_pop(struct runqueue *rq, int cpu)
+{
+  struct proc *p = 0, **pp;
+  struct proc *prev;
+
+  // peek without the lock first, so idle cpus polling each other's
+  // empty queues don't bounce the lock around
+  if(__atomic_load_n(&rq->n, __ATOMIC_RELAXED) == 0)
+    return 0;
+
+  acquire(&rq->lock);
+  for(int level = 0; level < NSCHEDLEVEL; level++){
+    prev = 0;
+    for(pp = &rq->head[level]; (p = *pp) != 0; pp = &p->rq_next){
+      if(p->affinity & (1U << cpu))
+        break;
+      prev = p;
+    }
+    if(p){
+      *pp = p->rq_next;
+      if(rq->tail[level] == p)
+        rq->tail[level] = prev;
+      p->rq_next = 0;
+      rq->n--;
+      if(p->affinity != ~0U)
+        rq->npinned--;
+      break;
+    }
+  }
+  release(&rq->lock);
+  return p;
+}
+
+#ifdef SCHED_MLFQ
+// is a process waiting on rq at a higher priority (lower level) than level?
+// only a hint: no lock is taken
+static int runqueue_has_above(struct runqueue *rq, int level)
+{
+  for(int i = 0; i < level; i++)
+    if(__atomic_load_n(&rq->head[i], __ATOMIC_RELAXED) != 0)
+      return 1;
+  return 0;
+}
+#endif
+
+// called on every timer interrupt that arrives while a process is
+// running, from usertrap() and kerneltrap().
+// round-robin gives up the cpu on every tick; mlfq charges the tick to
+// the process and gives up the cpu once its slice at the current level
+// is used up (moving it down a level), or if a process with a higher
+// priority is waiting.
+void sched_tick(void)
+{
+#ifdef SCHED_MLFQ
+  struct proc *p = myproc();
+  int preempt = 0;
+
+  acquire(&p->lock);
+  if(++p->ticks_used >= mlfq_slice[p->priority]){
+    if(p->priority < NSCHEDLEVEL-1)
+      p->priority++;
+    p->ticks_used = 0;
+    preempt = 1;
+  } else if(runqueue_has_above(&runqueues[p->cpu], p->priority)){
+    preempt = 1;
+  }
+  release(&p->lock);
+
+  if(preempt)
+    yield();
+#else
+  yield();
+#endif
+}
+
+#ifdef SCHED_MLFQ
+// move every process back to level 0, so cpu-bound processes that sank
+// to the bottom can't be starved by a stream of higher-priority ones.
+// called by clockintr() every MLFQ_BOOST_TICKS.
+void mlfq_boost(void)
+{
+  struct proc *p;
+
+  // queued processes: append the lower levels to level 0, in order
+  for(int i = 0; i < NCPU; i++){
+    struct runqueue *rq = &runqueues[i];
+    acquire(&rq->lock);
+    for(int level = 1; level < NSCHEDLEVEL; level++){
+      if(rq->head[level] == 0)
+        continue;
+      if(rq->tail[0])
+        rq->tail[0]->rq_next = rq->head[level];
+      else
+        rq->head[0] = rq->head[level];
+      rq->tail[0] = rq->tail[level];
+      rq->head[level] = rq->tail[level] = 0;
+    }
+    release(&rq->lock);
+  }
+
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    p->priority = 0;
+    p->ticks_used = 0;
+    release(&p->lock);
+  }
+}
+#endif
+
+// take a process that may run on cpu thief, whose own queue is empty,
+// from the longest other run queue that has one.
+// returns 0 if there's nothing to steal.
+static struct proc *runqueue_steal(int thief)
+{
+  struct proc *p;
+  uint tried = 1U << thief;
+
+  for(;;){
+    int victim = -1, most = 0;
+    for(int i = 0; i < NCPU; i++){
+      int n = __atomic_load_n(&runqueues[i].n, __ATOMIC_RELAXED);
+      if((tried & (1U << i)) == 0 && n > most){
+        most = n;
+        victim = i;
+      }
     }
+    if(victim < 0)
+      return 0;
+    // the victim may have emptied its queue since we looked, or
+    // hold only processes that can't run here
+    if((p = runqueue_pop(&runqueues[victim], thief)) != 0)
+      return p;
+    tried |= 1U << victim;
   }
 }
 
@@ -555,11 +1187,72 @@ void yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);     // protect process state
-  p->state = RUNNABLE;   // mark as ready to run (not currently running)
+  make_runnable(p);      // mark as ready to run and queue on this cpu
   sched();               // switch to scheduler
   release(&p->lock);     // release lock when we resume
 }
 
+// set p's affinity mask, keeping count of the restricted ones
+// caller holds p->lock
+static void affinity_set(struct proc *p, uint mask)
+{
+  if(p->affinity != ~0U)
+    __atomic_fetch_sub(&sched_pinned, 1, __ATOMIC_RELAXED);
+  if(mask != ~0U)
+    __atomic_fetch_add(&sched_pinned, 1, __ATOMIC_RELAXED);
+  p->affinity = mask;
+}
+
+// limit the current thread to the cpus in mask (bit i for cpu i),
+// moving it off this cpu at once if mask leaves it out. a mask
+// with every running cpu means any cpu. fork() and clone() pass
+// the mask on. mask 0 just asks for the current one.
+// returns the old mask, or -1 if mask names no running cpu.
+int set_affinity(uint mask)
+{
+  struct proc *p = myproc();
+  uint online = __atomic_load_n(&cpus_online, __ATOMIC_RELAXED);
+  uint old;
+  int move;
+
+  if(mask == 0)
+    return p->affinity & online;
+  if((mask & online) == 0)
+    return -1;
+  mask = (mask & online) == online ? ~0U : mask & online;
+
+  acquire(&p->lock);
+  old = p->affinity & online;
+  affinity_set(p, mask);
+  move = (p->affinity & (1U << cpuid())) == 0;
+  release(&p->lock);
+
+  // runqueue_push() finds it an allowed cpu
+  if(move)
+    yield();
+  return old;
+}
+
+// copy the scheduling counters of the first n cpus to st, and return
+// how many cpus are running (so entries past that are all zero).
+// the counters are read without locks, so they may be a little stale.
+int cpu_stats(struct cpustat *st, int n)
+{
+  uint online = __atomic_load_n(&cpus_online, __ATOMIC_RELAXED);
+  int ncpu = 0;
+
+  for(int i = 0; i < NCPU; i++){
+    if(online & (1U << i))
+      ncpu = i + 1;
+    if(i < n){
+      st[i].nswitch = __atomic_load_n(&cpus[i].nswitch, __ATOMIC_RELAXED);
+      st[i].migrations = __atomic_load_n(&cpus[i].migrations, __ATOMIC_RELAXED);
+      st[i].steals = __atomic_load_n(&cpus[i].steals, __ATOMIC_RELAXED);
+    }
+  }
+  return ncpu;
+}
+
 // a fork child's very first scheduling by scheduler() will swtch to forkret
 // this function completes the setup of a new process
 void forkret(void)
@@ -590,17 +1283,25 @@ void forkret(void)
 void sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct waitqueue *wq = waitqueue_for(chan);
   
-  // must acquire p->lock in order to change p->state and then call sched
-  // once we hold p->lock, we can be guaranteed that we won't miss any wake_up
-  // (wake_up locks p->lock), so it's okay to release lk
+  // the process goes on chan's wait queue and becomes SLEEPING while
+  // we hold both the wait queue lock and p->lock, and before lk is
+  // released: a wake_up(chan) by whoever takes lk next is sure to
+  // find us on the queue.
+  // p->lock is held on into sched(), as it must be.
 
-  acquire(&p->lock);  // protect process state changes
-  release(lk);        // release the lock we were holding
+  acquire(&wq->lock);  // lock order: wait queue, then p->lock
+  acquire(&p->lock);   // protect process state changes
 
   // go to sleep
   p->chan = chan;        // remember what we're waiting for
   p->state = SLEEPING;   // mark as sleeping (not runnable)
+  p->wq_next = wq->head;
+  wq->head = p;
+
+  release(lk);         // release the lock we were holding
+  release(&wq->lock);
 
   sched();  // switch to scheduler (process won't run until woken up)
 
@@ -614,34 +1315,41 @@ void sleep(void *chan, struct spinlock *lk)
 }
 
 // wake up all processes sleeping on the specified channel
-// scans entire process table to find sleeping processes waiting on this event
+// only looks at the processes on chan's wait queue, so the cost
+// depends on the number of sleepers, not on NPROC
 // must be called without holding any process lock to avoid deadlock
 // chan - the wait channel (memory address used as event identifier)
 void wake_up(void *wait_channel)
 {
-  struct proc *process_to_check;
-  
-  // scan all processes in the system process table
-  for(process_to_check = proc; process_to_check < &proc[NPROC]; process_to_check++) {
-    // skip the current running process (cannot wake up itself)
-    if(process_to_check != myproc()){
-      // acquire process lock for atomic state examination and modification
-      acquire(&process_to_check->lock);
-      
-      // check if this process is sleeping on the specified channel
-      if(process_to_check->state == SLEEPING && process_to_check->chan == wait_channel) {
-        // wake up the process by making it schedulable again
-        process_to_check->state = RUNNABLE;
-      }
-      
-      release(&process_to_check->lock);
+  struct waitqueue *wq = waitqueue_for(wait_channel);
+  struct proc **pp, *p;
+
+  // most wake_up()s find nobody waiting; don't take the lock for those.
+  // a sleeper adds itself while holding the lock the caller of wake_up()
+  // holds, so if it's not visible here it hasn't started sleeping yet.
+  if(__atomic_load_n(&wq->head, __ATOMIC_SEQ_CST) == 0)
+    return;
+
+  acquire(&wq->lock);
+  for(pp = &wq->head; (p = *pp) != 0; ){
+    // other channels may hash to the same queue
+    if(p->chan != wait_channel){
+      pp = &p->wq_next;
+      continue;
     }
+    *pp = p->wq_next;
+    p->wq_next = 0;
+    acquire(&p->lock);
+    make_runnable(p);  // wake up the process by making it schedulable again
+    release(&p->lock);
   }
+  release(&wq->lock);
 }
 
 // Kill the process with the given pid.
 // The victim won't exit until it tries to return
 // to user space (see usertrap() in trap.c).
+// A thread's id kills just that thread.
 int
 kill(int pid)
 {
@@ -650,11 +1358,7 @@ kill(int pid)
   for(p = proc; p < &proc[NPROC]; p++){
     acquire(&p->lock);
     if(p->pid == pid){
-      p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
+      kill_locked(p);
       release(&p->lock);
       return 0;
     }
@@ -663,6 +1367,34 @@ kill(int pid)
   return -1;
 }
 
+// Mark p killed, and wake it if it's asleep.
+// Caller holds p->lock.
+static void
+kill_locked(struct proc *p)
+{
+  p->killed = 1;
+  // Wake process from sleep(). That means taking it off its
+  // wait queue, whose lock comes before p->lock; so let go of
+  // p->lock and check that it's still asleep on the same chan
+  // once both are held.
+  while(p->state == SLEEPING){
+    void *chan = p->chan;
+    struct waitqueue *wq = waitqueue_for(chan);
+    release(&p->lock);
+    acquire(&wq->lock);
+    acquire(&p->lock);
+    if(p->state == SLEEPING && p->chan == chan){
+      struct proc **pp;
+      for(pp = &wq->head; *pp != p; pp = &(*pp)->wq_next)
+        ;
+      *pp = p->wq_next;
+      p->wq_next = 0;
+      make_runnable(p);
+    }
+    release(&wq->lock);
+  }
+}
+
 void
 setkilled(struct proc *p)
 {
@@ -727,20 +1459,145 @@ either_copyin(void *dst, int user_src, uint64 src, uint64 len)
   }
 }
 
+static char *states[] = {
+[UNUSED]    "unused",
+[USED]      "used",
+[SLEEPING]  "sleep ",
+[RUNNABLE]  "runble",
+[RUNNING]   "run   ",
+[ZOMBIE]    "zombie"
+};
+
+static char *
+state_name(struct proc *p)
+{
+  if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
+    return states[p->state];
+  return "???";
+}
+
+static void
+usage_add(struct usage *dst, struct usage *src)
+{
+  dst->cputime += src->cputime;
+  dst->nswitch += src->nswitch;
+  dst->nsyscall += src->nsyscall;
+  dst->nfault += src->nfault;
+  dst->nblockread += src->nblockread;
+}
+
+static void
+usage_out(struct rusage *ru, struct usage *u)
+{
+  ru->cputime = u->cputime;
+  ru->nswitch = u->nswitch;
+  ru->nsyscall = u->nsyscall;
+  ru->nfault = u->nfault;
+  ru->nblockread = u->nblockread;
+}
+
+// p's usage so far, counting the run it's in now if it's running
+// caller holds p->lock
+static struct usage
+usage_now(struct proc *p)
+{
+  struct usage u = p->ru;
+
+  if(p->state == RUNNING)
+    u.cputime += r_time() - p->run_start;
+  return u;
+}
+
+// count a disk block read for the current process, if any
+void
+rusage_blockread(void)
+{
+  struct proc *p = myproc();
+
+  if(p)
+    p->ru.nblockread++;
+}
+
+// copy the current process's usage (who is RUSAGE_SELF: all its
+// threads, live and joined) or its waited-for children's
+// (RUSAGE_CHILDREN) to the struct rusage at user address addr.
+// returns 0, or -1 on error.
+int
+getrusage(int who, uint64 addr)
+{
+  struct proc *p = myproc();
+  struct proc *g = p->group;
+  struct proc *t;
+  struct usage u, tu;
+  struct rusage ru;
+
+  if(who != RUSAGE_SELF && who != RUSAGE_CHILDREN)
+    return -1;
+
+  // wait_lock keeps the threads from being joined as we add them up
+  acquire(&wait_lock);
+  if(who == RUSAGE_CHILDREN){
+    u = g->cru;
+  } else {
+    u = g->tru;
+    for(t = proc; t < &proc[NPROC]; t++){
+      acquire(&t->lock);
+      if(t->group == g && t->state != UNUSED){
+        tu = usage_now(t);
+        usage_add(&u, &tu);
+      }
+      release(&t->lock);
+    }
+  }
+  release(&wait_lock);
+
+  usage_out(&ru, &u);
+  return copyout(p->pagetable, addr, (char *)&ru, sizeof(ru));
+}
+
+// copy a struct procinfo for each process (and thread) to the array
+// of n at user address addr, for ps. returns how many were copied.
+int
+procinfo(uint64 addr, int n)
+{
+  struct proc *p = myproc();
+  struct proc *pp;
+  struct procinfo pi;
+  struct usage u;
+  int i = 0;
+
+  for(pp = proc; pp < &proc[NPROC] && i < n; pp++){
+    acquire(&wait_lock);
+    acquire(&pp->lock);
+    if(pp->state == UNUSED){
+      release(&pp->lock);
+      release(&wait_lock);
+      continue;
+    }
+    pi.pid = pp->pid;
+    pi.ppid = pp->parent ? pp->parent->pid : 0;
+    pi.tgid = pp->group ? pp->group->pid : pp->pid;
+    pi.cpu = pp->lastcpu;
+    safestrcpy(pi.state, state_name(pp), sizeof(pi.state));
+    safestrcpy(pi.name, pp->name, sizeof(pi.name));
+    u = usage_now(pp);
+    usage_out(&pi.ru, &u);
+    release(&pp->lock);
+    release(&wait_lock);
+
+    if(copyout(p->pagetable, addr + i * sizeof(pi), (char *)&pi, sizeof(pi)) < 0)
+      return -1;
+    i++;
+  }
+  return i;
+}
+
 // Print a process listing to console.  For debugging.
 // Runs when user types ^P on console.
 // No lock to avoid wedging a stuck machine further.
 void
 procdump(void)
 {
-  static char *states[] = {
-  [UNUSED]    "unused",
-  [USED]      "used",
-  [SLEEPING]  "sleep ",
-  [RUNNABLE]  "runble",
-  [RUNNING]   "run   ",
-  [ZOMBIE]    "zombie"
-  };
   struct proc *p;
   char *state;
 
@@ -748,10 +1605,7 @@ procdump(void)
   for(p = proc; p < &proc[NPROC]; p++){
     if(p->state == UNUSED)
       continue;
-    if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
-      state = states[p->state];
-    else
-      state = "???";
+    state = state_name(p);
     printf("%d %s %s", p->pid, state, p->name);
     printf("\n");
   }
@@ -43,6 +43,11 @@ struct cpu {
   struct context context;     // saved registers for scheduler context switches
   int noff;                   // depth of push_off() nesting for interrupt control
   int intena;                 // were interrupts enabled before push_off()?
+  uint64 quantum;             // time csr cycles a process runs before the timer preempts it
+  int idle;                   // in the scheduler's wfi with no timer armed (tickless)
+  uint64 nswitch;             // times the scheduler switched to a process (see cpustat())
+  uint64 migrations;          // ...to one that last ran on another cpu
+  uint64 steals;              // processes taken from another cpu's run queue
 };
 
 extern struct cpu cpus[NCPU];
@@ -91,6 +96,7 @@ struct trapframe {
   /* 264 */ uint64 t4;
   /* 272 */ uint64 t5;
   /* 280 */ uint64 t6;
+  /* 288 */ uint64 kernel_flush_tlb; // no asids: flush the TLB at each satp switch
 };
 
 // process states - a process transitions through these states during its lifetime
@@ -103,6 +109,41 @@ enum procstate {
   ZOMBIE      // process has exited but parent hasn't collected exit status
 };
 
+// an ELF segment that exec() left to be demand paged from the executable:
+// [va, va+memsz) is mapped on first touch, the first filesz bytes coming
+// from the file at off and the rest zero-filled
+#define NEXECSEG 4
+struct execseg {
+  uint64 va;                   // page-aligned start of the segment
+  uint64 memsz;                // bytes in memory
+  uint64 filesz;               // bytes backed by the file
+  uint off;                    // file offset of va
+  int perm;                    // PTE_X/PTE_W bits for the segment's pages
+};
+
+// a region created by mmap(): [start, start+len) maps either the file
+// from offset off, or zero-filled anonymous memory. pages are faulted in
+// on first touch; see mmap.c.
+#define NVMA 16
+struct vma {
+  int used;                    // slot in use
+  uint64 start;                // page-aligned first address
+  uint64 len;                  // bytes, a multiple of PGSIZE
+  int prot;                    // PROT_ bits
+  int flags;                   // MAP_ bits
+  struct file *file;           // mapped file, or 0 if anonymous
+  uint64 off;                  // file offset of start
+};
+
+// resource usage counters, reported as a struct rusage (see getrusage())
+struct usage {
+  uint64 cputime;              // time csr cycles spent running
+  uint64 nswitch;              // times switched to
+  uint64 nsyscall;             // system calls made
+  uint64 nfault;               // page faults taken
+  uint64 nblockread;           // disk blocks read for it
+};
+
 // per-process state - the complete information about one process
 // this structure contains everything the kernel needs to manage a process
 struct proc {
@@ -111,20 +152,52 @@ struct proc {
   // these fields must be protected by p->lock:
   enum procstate state;        // current process state (see enum above)
   void *chan;                  // if sleeping, what event are we waiting for?
+  struct proc *wq_next;        // next sleeper on chan's wait queue (under its lock)
   int killed;                  // if non-zero, process should exit
   int xstate;                  // exit status to be returned to parent's wait()
   int pid;                     // process ID (unique identifier)
+  int cpu;                     // cpu whose run queue p goes on when RUNNABLE
+  int lastcpu;                 // cpu p last ran on, or -1 if it hasn't run yet
+  uint affinity;               // bit per cpu p may run on; changed only by p (see set_affinity())
+  uint64 wakeup_time;          // in sleep_until(), the time csr value to wake at
+  struct proc *timer_next;     // on the timer wheel (under its lock), see timer.c
+  struct proc **timer_pprev;   // link that points at p, or 0 if not on the wheel
+  int timer_level;             // wheel level p is filed in
+  int priority;                // scheduling level, 0 is highest (see SCHED_MLFQ)
+  int ticks_used;              // timer ticks charged to p at its current level
+  struct proc *rq_next;        // next process on the run queue (under its lock)
 
-  // wait_lock must be held when using this:
-  struct proc *parent;         // parent process (for wait/exit communication)
+  // wait_lock must be held when using these:
+  struct proc *parent;         // parent process (for wait/exit communication); 0 for a thread
+  struct proc *group;          // thread group leader (see clone()); p itself for a process
 
-  // these are private to the process, so p->lock need not be held:
+  // these are private to the thread, so p->lock need not be held:
   uint64 kstack;               // virtual address of kernel stack
-  uint64 sz;                   // size of process memory (bytes)
-  pagetable_t pagetable;       // user page table (virtual memory mappings)
+  pagetable_t pagetable;       // user page table (virtual memory mappings), shared by the group
   struct trapframe *trapframe; // saved user registers (page for trampoline.S)
+  uint64 trapframe_va;         // where trapframe is mapped in pagetable (TRAPFRAME or THREADFRAME())
   struct context context;      // saved kernel registers (for scheduler switches)
+  char name[16];               // process name (for debugging)
+  int asid;                    // address space id of pagetable in the TLB
+  uint tlb_stale;              // bit per cpu that must flush asid before running us
+  uint64 user_seq;             // odd while in user space; bumped at every kernel entry and exit
+  struct usage ru;             // usage so far; cputime and nswitch are updated under p->lock
+  uint64 run_start;            // time csr when p was last switched to
+
+  // the state threads share lives in their group leader, and only the
+  // leader's copy is used (p->group->sz and so on). group_lock protects
+  // it, along with changes to the shared page table, once there can be
+  // other threads; the leader alone may use it freely before clone()
+  // and after exit() has reaped them.
+  struct spinlock group_lock;
+  int nthreads;                // live threads in the group, the leader included
+  struct usage tru;            // usage of threads that have been joined (under wait_lock)
+  struct usage cru;            // usage of children that have been waited for (under wait_lock)
+  uint64 sz;                   // size of process memory (bytes)
   struct file *ofile[NOFILE];  // open files (file descriptors)
   struct inode *cwd;           // current working directory
-  char name[16];               // process name (for debugging)
+  struct inode *exec_ip;       // executable that text/data pages are faulted in from
+  struct execseg execseg[NEXECSEG]; // demand-paged segments of exec_ip
+  int nexecseg;                // number of valid execseg entries
+  struct vma vmas[NVMA];       // mmap() regions, below MMAPTOP
 };
@@ -238,6 +238,13 @@ static inline void w_pmpaddr0(uint64 x)
 // - converts physical address to page number by right-shifting 12 bits
 #define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12))
 
+// same, tagged with an address space id. TLB entries are tagged with the
+// asid they were loaded under, so switching between page tables with
+// different asids needs no flush. the kernel uses asid 0.
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_MASK (0xffffL << SATP_ASID_SHIFT)
+#define MAKE_SATP_ASID(pagetable, asid) (MAKE_SATP(pagetable) | (((uint64)(asid)) << SATP_ASID_SHIFT))
+
 // supervisor address translation and protection;
 // holds the address of the page table.
 static inline void write_supervisor_address_translation_and_protection_register(uint64 x)
@@ -352,6 +359,12 @@ static inline void sfence_vma()
   asm volatile("sfence.vma zero, zero");
 }
 
+// flush the TLB entries of one address space id
+static inline void sfence_vma_asid(uint64 asid)
+{
+  asm volatile("sfence.vma zero, %0" : : "r" (asid));
+}
+
 typedef uint64 pte_t;
 typedef uint64 *pagetable_t; // 512 PTEs
 
@@ -359,6 +372,7 @@ typedef uint64 *pagetable_t; // 512 PTEs
 
 #define PGSIZE 4096 // bytes per page
 #define PGSHIFT 12  // bits of offset within a page
+#define MEGAPGSIZE (512*PGSIZE) // bytes mapped by a level-1 leaf PTE (2MB megapage)
 
 #define PGROUNDUP(sz)  (((sz)+PGSIZE-1) & ~(PGSIZE-1)) // Rounds up to certain size -> PGROUNDUP(45) -> 4096 eg.
 #define PGROUNDDOWN(a) (((a)) & ~(PGSIZE-1))
@@ -368,6 +382,9 @@ typedef uint64 *pagetable_t; // 512 PTEs
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // user can access
+#define PTE_A (1L << 6) // accessed
+#define PTE_D (1L << 7) // dirty
+#define PTE_COW (1L << 8) // copy-on-write page (rsw bit, ignored by hardware)
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
@@ -0,0 +1,288 @@
+// slab allocator for small, fixed-size kernel objects
+//
+// kalloc() only hands out whole 4096-byte pages, which wastes most of a page
+// on objects like struct pipe or struct file. a kmem_cache carves pages
+// ("slabs") into equal-sized objects instead:
+// - each slab starts with a small header; the rest of the page is objects
+// - free objects in a slab are kept on a list threaded through the objects
+// - slabs with at least one free object sit on the cache's partial list,
+//   full slabs are on no list, and the owning slab of any object is found
+//   by rounding its address down to the page
+// - each cpu keeps a small magazine of free objects so the common
+//   alloc/free path only touches that cpu's lock, like kalloc's page caches
+// - a cache keeps at most one completely empty slab around; further empty
+//   slabs go straight back to kalloc, and kmem_cache_reclaim() returns
+//   everything not in use when kalloc runs out of pages
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define NKMEMCACHE       8                 // max number of object caches
+#define SLAB_MAG_SIZE    8                 // objects held by each cpu's magazine
+#define SLAB_MAG_BATCH   (SLAB_MAG_SIZE/2) // objects moved per refill or flush
+
+// free object - the first 8 bytes of a free object link it into its slab's list
+struct slab_free_object {
+  struct slab_free_object *next;
+};
+
+// slab header, stored at the start of the slab's page
+struct slab {
+  struct kmem_cache *cache;                 // cache this slab belongs to
+  struct slab *next;                        // links on the cache's partial list
+  struct slab *prev;
+  struct slab_free_object *free_objects;    // free objects in this slab
+  int inuse;                                // objects handed out (incl. those in magazines)
+};
+
+// per-cpu magazine of free objects
+struct kmem_cpu_cache {
+  struct spinlock lock;                     // only contended by kmem_cache_reclaim()
+  int count;                                // number of entries in objects[]
+  void *objects[SLAB_MAG_SIZE];
+};
+
+struct kmem_cache {
+  char *name;
+  uint object_size;                         // bytes per object, rounded up to 8
+  uint objects_per_slab;
+  struct spinlock lock;                     // protects the slab lists and counts below
+  struct slab *partial;                     // slabs with at least one free object
+  int nslabs;                               // slabs owned by this cache
+  int nempty;                               // slabs on partial with no objects in use
+  struct kmem_cpu_cache cpu[NCPU];          // one magazine per cpu, indexed by cpuid()
+};
+
+// caches are only created during boot, by cpu 0, so the table needs no lock
+static struct kmem_cache kmem_caches[NKMEMCACHE];
+static int nkmem_caches;
+
+#define SLAB_OBJECTS_START  ((sizeof(struct slab) + 7) & ~7L)
+
+static int slab_grow(struct kmem_cache *cache);
+static void slab_unlink(struct kmem_cache *cache, struct slab *s);
+static void refill_cpu_object_cache(struct kmem_cache *cache, struct kmem_cpu_cache *mag);
+static void flush_cpu_object_cache(struct kmem_cache *cache, struct kmem_cpu_cache *mag, int n);
+
+// create a cache of objects of the given size
+// called during boot, before other cpus start
+struct kmem_cache * kmem_cache_create(char *name, uint size)
+{
+  struct kmem_cache *cache;
+
+  if(nkmem_caches >= NKMEMCACHE)
+    panic("kmem_cache_create: too many caches");
+
+  size = (size + 7) & ~7;
+  if(size < sizeof(struct slab_free_object))
+    size = sizeof(struct slab_free_object);
+  if(size > PGSIZE - SLAB_OBJECTS_START)
+    panic("kmem_cache_create: object too big");
+
+  cache = &kmem_caches[nkmem_caches++];
+  cache->name = name;
+  cache->object_size = size;
+  cache->objects_per_slab = (PGSIZE - SLAB_OBJECTS_START) / size;
+  create_lock(&cache->lock, name);
+  for(int i = 0; i < NCPU; i++)
+    create_lock(&cache->cpu[i].lock, "kmem_cache_cpu");
+  return cache;
+}
+
+// allocate one object from cache
+// the contents are not initialized; returns 0 if out of memory
+void * kmem_cache_alloc(struct kmem_cache *cache)
+{
+  void *object = 0;
+
+  // interrupts stay off so we can't migrate to another cpu mid-way
+  push_off();
+  struct kmem_cpu_cache *mag = &cache->cpu[cpuid()];
+  acquire(&mag->lock);
+  if(mag->count == 0)
+    refill_cpu_object_cache(cache, mag);
+  if(mag->count > 0)
+    object = mag->objects[--mag->count];
+  release(&mag->lock);
+  pop_off();
+
+  return object;
+}
+
+// return an object previously allocated from cache
+void kmem_cache_free(struct kmem_cache *cache, void *object)
+{
+  struct slab *s = (struct slab*)PGROUNDDOWN((uint64)object);
+
+  if(s->cache != cache || ((uint64)object - (uint64)s - SLAB_OBJECTS_START) % cache->object_size)
+    panic("kmem_cache_free");
+
+  push_off();
+  struct kmem_cpu_cache *mag = &cache->cpu[cpuid()];
+  acquire(&mag->lock);
+  if(mag->count == SLAB_MAG_SIZE)
+    flush_cpu_object_cache(cache, mag, SLAB_MAG_BATCH);
+  mag->objects[mag->count++] = object;
+  release(&mag->lock);
+  pop_off();
+}
+
+// give every free object and empty slab in every cache back to kalloc
+// called by kalloc() when it runs out of pages; must not be called with
+// any spinlock held, since it takes the magazine and cache locks
+// returns the number of pages freed
+int kmem_cache_reclaim(void)
+{
+  int freed = 0;
+
+  for(int i = 0; i < nkmem_caches; i++){
+    struct kmem_cache *cache = &kmem_caches[i];
+    struct slab *empty = 0, *s, *next;
+
+    for(int c = 0; c < NCPU; c++){
+      struct kmem_cpu_cache *mag = &cache->cpu[c];
+      acquire(&mag->lock);
+      flush_cpu_object_cache(cache, mag, mag->count);
+      release(&mag->lock);
+    }
+
+    acquire(&cache->lock);
+    for(s = cache->partial; s; s = next){
+      next = s->next;
+      if(s->inuse == 0){
+        slab_unlink(cache, s);
+        cache->nempty--;
+        cache->nslabs--;
+        s->next = empty;
+        empty = s;
+      }
+    }
+    release(&cache->lock);
+
+    for(s = empty; s; s = next){
+      next = s->next;
+      kernel_free_page(s);
+      freed++;
+    }
+  }
+  return freed;
+}
+
+// add a fresh slab to cache's partial list
+// called without cache->lock held, since kalloc() may take a while
+// returns 0 on success, -1 if out of memory
+static int slab_grow(struct kmem_cache *cache)
+{
+  struct slab *s = (struct slab*)kalloc();
+  char *object;
+
+  if(s == 0)
+    return -1;
+
+  s->cache = cache;
+  s->inuse = 0;
+  s->free_objects = 0;
+  // build the free list back to front so objects are handed out in address order
+  object = (char*)s + SLAB_OBJECTS_START + (cache->objects_per_slab - 1) * cache->object_size;
+  for(uint i = 0; i < cache->objects_per_slab; i++, object -= cache->object_size){
+    struct slab_free_object *f = (struct slab_free_object*)object;
+    f->next = s->free_objects;
+    s->free_objects = f;
+  }
+
+  acquire(&cache->lock);
+  s->prev = 0;
+  s->next = cache->partial;
+  if(s->next)
+    s->next->prev = s;
+  cache->partial = s;
+  cache->nslabs++;
+  cache->nempty++;
+  release(&cache->lock);
+  return 0;
+}
+
+// take slab s off cache's partial list
+// caller holds cache->lock
+static void slab_unlink(struct kmem_cache *cache, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    cache->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+}
+
+// move up to SLAB_MAG_BATCH objects from the cache's slabs into mag,
+// growing the cache by one slab if it has no free objects at all
+// caller holds mag->lock (lock order: magazine, then cache)
+static void refill_cpu_object_cache(struct kmem_cache *cache, struct kmem_cpu_cache *mag)
+{
+  acquire(&cache->lock);
+  while(mag->count < SLAB_MAG_BATCH){
+    struct slab *s = cache->partial;
+    if(s == 0){
+      if(mag->count > 0)
+        break;
+      release(&cache->lock);
+      if(slab_grow(cache) < 0)
+        return;
+      acquire(&cache->lock);
+      continue;
+    }
+    struct slab_free_object *f = s->free_objects;
+    s->free_objects = f->next;
+    if(s->inuse++ == 0)
+      cache->nempty--;
+    if(s->free_objects == 0)
+      slab_unlink(cache, s);  // now full
+    mag->objects[mag->count++] = f;
+  }
+  release(&cache->lock);
+}
+
+// return the top n objects of mag to their slabs
+// keeps at most one empty slab in the cache; the rest go back to kalloc
+// caller holds mag->lock
+static void flush_cpu_object_cache(struct kmem_cache *cache, struct kmem_cpu_cache *mag, int n)
+{
+  struct slab *empty = 0, *s;
+
+  acquire(&cache->lock);
+  for(; n > 0 && mag->count > 0; n--){
+    struct slab_free_object *f = mag->objects[--mag->count];
+    s = (struct slab*)PGROUNDDOWN((uint64)f);
+    if(s->free_objects == 0){
+      // was full - back onto the partial list
+      s->prev = 0;
+      s->next = cache->partial;
+      if(s->next)
+        s->next->prev = s;
+      cache->partial = s;
+    }
+    f->next = s->free_objects;
+    s->free_objects = f;
+    if(--s->inuse == 0){
+      if(cache->nempty > 0){
+        slab_unlink(cache, s);
+        cache->nslabs--;
+        s->next = empty;
+        empty = s;
+      } else {
+        cache->nempty++;
+      }
+    }
+  }
+  release(&cache->lock);
+
+  while(empty){
+    s = empty;
+    empty = s->next;
+    kernel_free_page(s);
+  }
+}
@@ -15,6 +15,8 @@ void create_lock(struct spinlock *lk, char *name)
   lk->name = name;
   lk->locked = 0;
   lk->cpu = 0;
+  lk->nacquire = 0;
+  lk->ncontended = 0;
 }
 
 // Acquire the lock.
@@ -34,8 +36,9 @@ void acquire(struct spinlock *lk)
   // Built-in atomic operations
   // If we didn't get the lock, spin forever
   // If we swapped it, then we can move beyond the lock
+  int spun = 0;
   while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
-    ;
+    spun = 1;
   
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -45,6 +48,11 @@ void acquire(struct spinlock *lk)
 
   // Record info about lock acquisition for holding() and debugging.
   lk->cpu = mycpu();
+
+  // safe to update without atomics - we own the lock now
+  lk->nacquire++;
+  if(spun)
+    lk->ncontended++;
 }
 
 // Release the lock.
@@ -89,6 +97,18 @@ int holding(struct spinlock *lk)
   return r;
 }
 
+// Check whether this cpu holds any spinlock (or has
+// otherwise pushed interrupts off), i.e. whether the
+// caller must not sleep.
+int holding_spinlocks(void)
+{
+  int r;
+  push_off();
+  r = mycpu()->noff > 1;
+  pop_off();
+  return r;
+}
+
 // push_off/pop_off are like intr_off()/intr_on() except that they are matched:
 // it takes two pop_off()s to undo two push_off()s.  Also, if interrupts
 // are initially off, then push_off, pop_off leaves them off.
@@ -6,5 +6,9 @@ struct spinlock {
   char *name;        // Name of lock.
   
   struct cpu *cpu;   // The cpu holding the lock.
+
+  // contention statistics, updated while the lock is held
+  uint64 nacquire;   // number of successful acquires
+  uint64 ncontended; // acquires that had to spin for another cpu
 };
 
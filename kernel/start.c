@@ -140,6 +140,6 @@ void timerinit()
     
     // schedule the first timer interrupt
     // stimecmp (supervisor timer compare) triggers interrupt when time >= stimecmp
-    // 1000000 cycles is roughly 1/10 second on typical risc-v systems
-    w_stimecmp(r_time() + 1000000);
+    // TICK_CYCLES is roughly 1/10 second on typical risc-v systems
+    w_stimecmp(r_time() + TICK_CYCLES);
 }
@@ -9,3 +9,52 @@ struct stat {
   short nlink; // Number of links to file
   uint64 size; // Size of file in bytes
 };
+
+// physical page allocator statistics, filled in by kmemstat()
+struct kmemstat {
+  uint64 free_pages;       // free pages, global list plus all per-cpu caches
+  uint64 global_acquires;  // times the global free list lock was taken
+  uint64 global_contended; // ...of which had to spin waiting for another cpu
+  uint64 steals;           // pages one cpu took from another cpu's cache
+};
+
+// resource usage of a process, from getrusage() and waitrusage()
+#define RUSAGE_SELF     0  // the calling process, all its threads
+#define RUSAGE_CHILDREN 1  // its children that have been waited for
+
+struct rusage {
+  uint64 cputime;          // time csr cycles spent running
+  uint64 nswitch;          // times it was switched to
+  uint64 nsyscall;         // system calls made
+  uint64 nfault;           // page faults taken
+  uint64 nblockread;       // disk blocks read for it
+};
+
+// one process, as listed by procinfo()
+struct procinfo {
+  int pid;
+  int ppid;                // parent's pid, or 0
+  int tgid;                // pid of the thread group leader (see clone())
+  int cpu;                 // cpu it last ran on, or -1 if it hasn't yet
+  char state[8];
+  char name[16];
+  struct rusage ru;        // this thread's usage alone
+};
+
+// buffer cache statistics, filled in by bcachestat()
+struct bcachestat {
+  uint64 hits;             // lookups that found the block cached
+  uint64 misses;           // ...that had to give it a buffer
+  uint64 ghosthits;        // misses on a block read once and recycled recently,
+                           // which go straight to the hot list
+  uint64 readahead;        // blocks breadahead() started reading
+  uint64 nbuf;             // buffers in the cache
+  uint64 nhot;             // ...of which on the hot list
+};
+
+// per-cpu scheduling statistics, filled in by cpustat()
+struct cpustat {
+  uint64 nswitch;          // times the cpu switched to a process
+  uint64 migrations;       // ...that had last run on another cpu
+  uint64 steals;           // processes it took from another cpu's run queue
+};
@@ -21,6 +21,7 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "syscall.h"
+#include "trace.h"
 #include "defs.h"
 
 // safely fetch a 64-bit value from user virtual address space
@@ -32,8 +33,8 @@ int fetchaddr(uint64 user_virtual_address, uint64 *kernel_destination_pointer)
   
   // comprehensive bounds checking to prevent buffer overflow attacks
   // check if address is within process memory bounds (both tests needed for overflow protection)
-  if(user_virtual_address >= current_process->sz || 
-     user_virtual_address + sizeof(uint64) > current_process->sz)
+  if(user_virtual_address >= current_process->group->sz || 
+     user_virtual_address + sizeof(uint64) > current_process->group->sz)
     return -1;
     
   // use copyin to safely copy from user page table to kernel memory
@@ -134,6 +135,21 @@ extern uint64 sys_unlink(void);  // unlink file
 extern uint64 sys_link(void);    // link file
 extern uint64 sys_mkdir(void);   // make directory
 extern uint64 sys_close(void);   // close file descriptor
+extern uint64 sys_kmemstat(void); // page allocator statistics
+extern uint64 sys_mmap(void);    // map file or memory
+extern uint64 sys_munmap(void);  // unmap memory
+extern uint64 sys_setquantum(void); // set scheduler time slice
+extern uint64 sys_nanosleep(void); // sleep in nanoseconds
+extern uint64 sys_clone(void);   // create thread
+extern uint64 sys_join(void);    // wait for thread
+extern uint64 sys_futex_wait(void); // sleep on a user word
+extern uint64 sys_futex_wake(void); // wake sleepers on a user word
+extern uint64 sys_set_affinity(void); // set cpu affinity
+extern uint64 sys_cpustat(void); // per-cpu scheduling statistics
+extern uint64 sys_getrusage(void); // resource usage
+extern uint64 sys_waitrusage(void); // wait with child resource usage
+extern uint64 sys_procinfo(void); // list processes
+extern uint64 sys_bcachestat(void); // buffer cache statistics
 
 // system call dispatch table - maps system call numbers to handler functions
 // this array is indexed by system call number to find the correct function
@@ -159,6 +175,21 @@ static uint64 (*syscalls[])(void) = {
 [SYS_link]    sys_link,
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
+[SYS_kmemstat] sys_kmemstat,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_setquantum] sys_setquantum,
+[SYS_nanosleep] sys_nanosleep,
+[SYS_clone]   sys_clone,
+[SYS_join]    sys_join,
+[SYS_futex_wait] sys_futex_wait,
+[SYS_futex_wake] sys_futex_wake,
+[SYS_set_affinity] sys_set_affinity,
+[SYS_cpustat] sys_cpustat,
+[SYS_getrusage] sys_getrusage,
+[SYS_waitrusage] sys_waitrusage,
+[SYS_procinfo] sys_procinfo,
+[SYS_bcachestat] sys_bcachestat,
 };
 
 // main system call dispatcher
@@ -175,7 +206,10 @@ void syscall(void)
   if(num > 0 && num < NELEM(syscalls) && syscalls[num]) {
     // call the system call handler function and store return value in a0
     // user program will see this return value when system call completes
+    p->ru.nsyscall++;
+    trace_record(TRACE_SYSCALL, p->pid, num);
     p->trapframe->a0 = syscalls[num]();
+    trace_record(TRACE_SYSRET, p->pid, num);
   } else {
     // invalid system call number
     printf("%d %s: unknown sys call %d\n",
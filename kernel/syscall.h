@@ -15,6 +15,17 @@
 #define SYS_kill    6   // send signal to process
 #define SYS_exec    7   // replace current process with new program
 #define SYS_sleep  13   // sleep for specified number of timer ticks
+#define SYS_setquantum 25 // set the scheduler time slice
+#define SYS_nanosleep 26 // sleep for a number of nanoseconds
+#define SYS_clone  27   // create a thread sharing this process's memory
+#define SYS_join   28   // wait for a thread to exit
+#define SYS_futex_wait 29 // sleep while a user memory word holds a value
+#define SYS_futex_wake 30 // wake threads sleeping on a user memory word
+#define SYS_set_affinity 31 // limit this thread to some of the cpus
+#define SYS_cpustat 32 // per-cpu scheduling statistics
+#define SYS_getrusage 33 // resource usage of this process or its children
+#define SYS_waitrusage 34 // wait(), also returning the child's resource usage
+#define SYS_procinfo 35 // list the processes
 
 // file system calls
 #define SYS_open   15   // open file and return file descriptor
@@ -34,6 +45,10 @@
 // information and status calls  
 #define SYS_fstat   8   // get file information
 #define SYS_uptime 14   // get system uptime in ticks
+#define SYS_bcachestat 36 // buffer cache statistics
 
 // memory management
 #define SYS_sbrk   12   // grow/shrink process memory
+#define SYS_kmemstat 22 // physical page allocator statistics
+#define SYS_mmap   23   // map a file or anonymous memory
+#define SYS_munmap 24   // remove a mapping
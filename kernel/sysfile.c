@@ -17,21 +17,44 @@
 #include "fcntl.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
-// and return both the descriptor and the corresponding struct file.
+// and return the corresponding struct file. Another thread of the
+// process could close the descriptor while the caller is still using
+// f, so then f gets a reference of its own and argfd() returns 1; the
+// caller hands that to fdput() when done. A process with one thread
+// can't close the descriptor under itself (nor start a thread that
+// could, until the system call returns), so then f is just borrowed
+// from the table and argfd() returns 0. Returns -1 on error.
 static int
-argfd(int n, int *pfd, struct file **pf)
+argfd(int n, struct file **pf)
 {
   int fd;
   struct file *f;
+  struct proc *g = myproc()->group;
 
   argint(n, &fd);
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if(fd < 0 || fd >= NOFILE)
     return -1;
-  if(pfd)
-    *pfd = fd;
-  if(pf)
-    *pf = f;
-  return 0;
+  if(g->nthreads == 1){
+    if((*pf = g->ofile[fd]) == 0)
+      return -1;
+    return 0;
+  }
+  acquire(&g->group_lock);
+  if((f = g->ofile[fd]) != 0)
+    filedup(f);
+  release(&g->group_lock);
+  if(f == 0)
+    return -1;
+  *pf = f;
+  return 1;
+}
+
+// Done with a file argfd() returned.
+static void
+fdput(struct file *f, int ref)
+{
+  if(ref)
+    fileclose(f);
 }
 
 // Allocate a file descriptor for the given file.
@@ -40,28 +63,54 @@ static int
 fdalloc(struct file *f)
 {
   int fd;
-  struct proc *p = myproc();
+  struct proc *g = myproc()->group;
 
+  acquire(&g->group_lock);
   for(fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd] == 0){
-      p->ofile[fd] = f;
+    if(g->ofile[fd] == 0){
+      g->ofile[fd] = f;
+      release(&g->group_lock);
       return fd;
     }
   }
+  release(&g->group_lock);
   return -1;
 }
 
+// Take fd out of the descriptor table, if it still refers to f
+// (or to anything, if f is 0), and return the file it referred to.
+// The caller drops the table's reference with fileclose().
+static struct file*
+fdfree(int fd, struct file *f)
+{
+  struct proc *g = myproc()->group;
+  struct file *old;
+
+  acquire(&g->group_lock);
+  old = g->ofile[fd];
+  if(f && old != f)
+    old = 0;
+  if(old)
+    g->ofile[fd] = 0;
+  release(&g->group_lock);
+  return old;
+}
+
 uint64
 sys_dup(void)
 {
   struct file *f;
-  int fd;
+  int fd, ref;
 
-  if(argfd(0, 0, &f) < 0)
+  // the new descriptor needs a reference of its own
+  if((ref = argfd(0, &f)) < 0)
     return -1;
-  if((fd=fdalloc(f)) < 0)
+  if(!ref)
+    filedup(f);
+  if((fd=fdalloc(f)) < 0){
+    fileclose(f);
     return -1;
-  filedup(f);
+  }
   return fd;
 }
 
@@ -69,29 +118,33 @@ uint64
 sys_read(void)
 {
   struct file *f;
-  int n;
+  int n, r, ref;
   uint64 p;
 
   argaddr(1, &p);
   argint(2, &n);
-  if(argfd(0, 0, &f) < 0)
+  if((ref = argfd(0, &f)) < 0)
     return -1;
-  return fileread(f, p, n);
+  r = fileread(f, p, n);
+  fdput(f, ref);
+  return r;
 }
 
 uint64
 sys_write(void)
 {
   struct file *f;
-  int n;
+  int n, r, ref;
   uint64 p;
   
   argaddr(1, &p);
   argint(2, &n);
-  if(argfd(0, 0, &f) < 0)
+  if((ref = argfd(0, &f)) < 0)
     return -1;
 
-  return filewrite(f, p, n);
+  r = filewrite(f, p, n);
+  fdput(f, ref);
+  return r;
 }
 
 uint64
@@ -100,9 +153,9 @@ sys_close(void)
   int fd;
   struct file *f;
 
-  if(argfd(0, &fd, &f) < 0)
+  argint(0, &fd);
+  if(fd < 0 || fd >= NOFILE || (f = fdfree(fd, 0)) == 0)
     return -1;
-  myproc()->ofile[fd] = 0;
   fileclose(f);
   return 0;
 }
@@ -111,12 +164,15 @@ uint64
 sys_fstat(void)
 {
   struct file *f;
+  int r, ref;
   uint64 st; // user pointer to struct stat
 
   argaddr(1, &st);
-  if(argfd(0, 0, &f) < 0)
+  if((ref = argfd(0, &f)) < 0)
     return -1;
-  return filestat(f, st);
+  r = filestat(f, st);
+  fdput(f, ref);
+  return r;
 }
 
 // Create the path new as a link to the same inode as old.
@@ -410,7 +466,7 @@ uint64
 sys_chdir(void)
 {
   char path[MAXPATH];
-  struct inode *ip;
+  struct inode *ip, *old;
   struct proc *p = myproc();
   
   begin_op();
@@ -425,9 +481,13 @@ sys_chdir(void)
     return -1;
   }
   iunlock(ip);
-  iput(p->cwd);
+  // the process's threads share one current directory
+  acquire(&p->group->group_lock);
+  old = p->group->cwd;
+  p->group->cwd = ip;
+  release(&p->group->group_lock);
+  iput(old);
   end_op();
-  p->cwd = ip;
   return 0;
 }
 
@@ -487,19 +547,50 @@ sys_pipe(void)
     return -1;
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
-    if(fd0 >= 0)
-      p->ofile[fd0] = 0;
-    fileclose(rf);
+    if(fd0 < 0 || fdfree(fd0, rf))
+      fileclose(rf);
     fileclose(wf);
     return -1;
   }
   if(copyout(p->pagetable, fdarray, (char*)&fd0, sizeof(fd0)) < 0 ||
      copyout(p->pagetable, fdarray+sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0){
-    p->ofile[fd0] = 0;
-    p->ofile[fd1] = 0;
-    fileclose(rf);
-    fileclose(wf);
+    // unless another thread already closed them
+    if(fdfree(fd0, rf))
+      fileclose(rf);
+    if(fdfree(fd1, wf))
+      fileclose(wf);
     return -1;
   }
   return 0;
 }
+
+// void *mmap(void *addr, uint64 len, int prot, int flags, int fd, uint64 off)
+// addr is only a hint and is ignored; the kernel picks the address.
+uint64
+sys_mmap(void)
+{
+  uint64 len, off, r;
+  int prot, flags, ref = 0;
+  struct file *f = 0;
+
+  argaddr(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argaddr(5, &off);
+  if((flags & MAP_ANONYMOUS) == 0 && (ref = argfd(4, &f)) < 0)
+    return -1;
+  r = mmap(len, prot, flags, f, off);
+  if(f)
+    fdput(f, ref);
+  return r;
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  return munmap(addr, len);
+}
@@ -5,6 +5,7 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "stat.h"
 
 uint64
 sys_exit(void)
@@ -32,20 +33,74 @@ sys_wait(void)
 {
   uint64 p;
   argaddr(0, &p);
-  return wait(p);
+  return wait(p, 0);
 }
 
+// wait() that also copies the child's struct rusage to user
+// address ru, if it isn't 0
 uint64
-sys_sbrk(void)
+sys_waitrusage(void)
+{
+  uint64 p, ru;
+
+  argaddr(0, &p);
+  argaddr(1, &ru);
+  return wait(p, ru);
+}
+
+// int clone(void (*fn)(void*), void *arg, void *stack)
+// stack is the top of the new thread's stack
+uint64
+sys_clone(void)
+{
+  uint64 fn, arg, stack;
+
+  argaddr(0, &fn);
+  argaddr(1, &arg);
+  argaddr(2, &stack);
+  return clone(fn, arg, stack);
+}
+
+uint64
+sys_join(void)
+{
+  int tid;
+
+  argint(0, &tid);
+  return join(tid);
+}
+
+// sleep until futex_wake() on addr, if the int at addr is val
+uint64
+sys_futex_wait(void)
+{
+  uint64 addr;
+  int val;
+
+  argaddr(0, &addr);
+  argint(1, &val);
+  return futex_wait(addr, val);
+}
+
+// wake up to n threads sleeping in futex_wait() on addr
+uint64
+sys_futex_wake(void)
 {
   uint64 addr;
   int n;
 
+  argaddr(0, &addr);
+  argint(1, &n);
+  return futex_wake(addr, n);
+}
+
+uint64
+sys_sbrk(void)
+{
+  int n;
+
   argint(0, &n);
-  addr = myproc()->sz;
-  if(growproc(n) < 0)
-    return -1;
-  return addr;
+  return growproc(n);
 }
 
 uint64
@@ -58,16 +113,28 @@ sys_sleep(void)
   if(n < 0)
     n = 0;
   acquire(&tickslock);
+  update_ticks();
   ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(killed(myproc())){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
   release(&tickslock);
-  return 0;
+  // wake when ticks reaches ticks0 + n, as if counting tick interrupts
+  return sleep_until(tick_time(ticks0 + n));
+}
+
+// sleep for the given number of nanoseconds, with the resolution of
+// the time csr rather than of ticks
+uint64
+sys_nanosleep(void)
+{
+  uint64 nsec;
+
+  argaddr(0, &nsec);
+  // round up to whole cycles without wrapping, and make a deadline
+  // past the end of time just that, rather than one in the past
+  uint64 cycles = nsec / NSEC_PER_CYCLE + (nsec % NSEC_PER_CYCLE != 0);
+  uint64 now = r_time();
+  if(cycles > ~0ULL - now)
+    return sleep_until(~0ULL);
+  return sleep_until(now + cycles);
 }
 
 uint64
@@ -87,7 +154,118 @@ sys_uptime(void)
   uint xticks;
 
   acquire(&tickslock);
+  update_ticks();
   xticks = ticks;
   release(&tickslock);
   return xticks;
 }
+
+// set the time slice of cpu, or of every cpu if cpu is -1,
+// to usec microseconds (0 restores the default).
+// takes effect at each cpu's next timer interrupt or context switch.
+uint64
+sys_setquantum(void)
+{
+  int cpu, usec;
+  uint64 cycles;
+
+  argint(0, &cpu);
+  argint(1, &usec);
+  if(cpu < -1 || cpu >= NCPU)
+    return -1;
+  // below a millisecond the timer interrupts would crowd out the processes
+  if(usec != 0 && (usec < 1000 || usec > 10000000))
+    return -1;
+  cycles = usec ? (uint64)usec * (TIMEBASE_FREQ / 1000000) : QUANTUM_CYCLES;
+  for(int i = 0; i < NCPU; i++)
+    if(cpu == -1 || cpu == i)
+      cpus[i].quantum = cycles;
+  return 0;
+}
+
+// copy physical page allocator statistics to the
+// struct kmemstat at user address addr.
+uint64
+sys_kmemstat(void)
+{
+  uint64 addr;
+  struct kmemstat st;
+
+  argaddr(0, &addr);
+  kalloc_stats(&st);
+  if(copyout(myproc()->pagetable, addr, (char *)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
+// limit the calling thread to the cpus in a mask; returns the old mask
+uint64
+sys_set_affinity(void)
+{
+  int mask;
+
+  argint(0, &mask);
+  return set_affinity(mask);
+}
+
+// copy the struct cpustat of the first n cpus to the array at
+// user address addr. returns the number of running cpus.
+uint64
+sys_cpustat(void)
+{
+  uint64 addr;
+  int n;
+  struct cpustat st[NCPU];
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  if(n < 0)
+    return -1;
+  if(n > NCPU)
+    n = NCPU;
+  int ncpu = cpu_stats(st, n);
+  if(copyout(myproc()->pagetable, addr, (char *)st, n * sizeof(st[0])) < 0)
+    return -1;
+  return ncpu;
+}
+
+// copy the resource usage of this process (RUSAGE_SELF) or of its
+// waited-for children (RUSAGE_CHILDREN) to a struct rusage
+uint64
+sys_getrusage(void)
+{
+  int who;
+  uint64 addr;
+
+  argint(0, &who);
+  argaddr(1, &addr);
+  return getrusage(who, addr);
+}
+
+// copy a struct procinfo per process to an array of n;
+// returns how many
+uint64
+sys_procinfo(void)
+{
+  uint64 addr;
+  int n;
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  return procinfo(addr, n);
+}
+
+// buffer cache statistics: copy a struct bcachestat
+// to user address addr.
+uint64
+sys_bcachestat(void)
+{
+  uint64 addr;
+  struct bcachestat st;
+
+  argaddr(0, &addr);
+  bcache_stats(&st);
+  if(copyout(myproc()->pagetable, addr, (char *)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
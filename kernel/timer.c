@@ -0,0 +1,233 @@
+// timed sleeps: a hierarchical timer wheel of sleeping processes
+//
+// sleep() and nanosleep() used to sleep on &ticks, so every tick woke
+// every sleeping process just for most of them to go back to sleep.
+// now each sleeper is filed on a timer wheel under its deadline (in
+// time csr cycles) and only woken once that has passed:
+// - level 0 has TW_SLOTS slots of 2^TW_SHIFT cycles (about 0.4ms) each,
+//   covering the next TW_SLOTS slots; every level above has slots
+//   TW_SLOTS times as wide
+// - a process goes in the lowest level whose range reaches its
+//   deadline. when the wheel's time enters a new level-l slot, the
+//   processes in the matching level l+1 slot are "cascaded": filed
+//   again, now in a lower level
+// - timer interrupts call timer_expire(), which moves the wheel up to
+//   the current time and wakes whoever is due. timer_arm() asks for an
+//   interrupt at timer_next_expiry(), so a deadline is met to within
+//   the interrupt latency, not rounded up to a tick
+// this is the classic scheme of the old Linux timer_list wheel; inserting
+// and removing are O(1), and expiring only looks at due processes.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#define TW_SHIFT   12                   // log2 of level 0 slot width, in cycles
+#define TW_BITS    6
+#define TW_SLOTS   (1 << TW_BITS)       // slots per level
+#define TW_MASK    (TW_SLOTS - 1)
+#define TW_LEVELS  4                    // 2^(12+24) cycles, almost two hours, ahead
+
+struct {
+  struct spinlock lock;
+  uint64 now;                           // expired up to here, in level 0 slots
+  struct proc *slots[TW_LEVELS][TW_SLOTS];  // sleepers, via timer_next
+  int count[TW_LEVELS];                 // sleepers in each level
+  uint64 next_expiry;                   // no one is due before this time (cycles)
+} wheel;
+
+static void wheel_insert(struct proc *p);
+static void wheel_remove(struct proc *p);
+static void wheel_cascade(int level);
+static void wheel_update_next(void);
+
+void
+timer_wheel_init(void)
+{
+  create_lock(&wheel.lock, "timer wheel");
+  wheel.now = r_time() >> TW_SHIFT;
+  wheel.next_expiry = ~0UL;
+}
+
+// put the current process to sleep until the time csr reaches deadline.
+// returns 0, or -1 if the process was killed first.
+int
+sleep_until(uint64 deadline)
+{
+  struct proc *p = myproc();
+
+  acquire(&wheel.lock);
+  p->wakeup_time = deadline;
+  while(r_time() < deadline){
+    if(killed(p)){
+      release(&wheel.lock);
+      return -1;
+    }
+    wheel_insert(p);
+    sleep(&p->wakeup_time, &wheel.lock);
+    // timer_expire() takes us off the wheel; kill() doesn't
+    if(p->timer_pprev)
+      wheel_remove(p);
+  }
+  release(&wheel.lock);
+  return 0;
+}
+
+// wake the processes whose deadline has passed.
+// called on every timer interrupt.
+void
+timer_expire(void)
+{
+  uint64 time = r_time();
+  uint64 target = time >> TW_SHIFT;
+  struct proc *p, *next;
+
+  // nothing due: don't take the lock on every cpu's every interrupt
+  if(time < __atomic_load_n(&wheel.next_expiry, __ATOMIC_RELAXED))
+    return;
+
+  acquire(&wheel.lock);
+  for(;;){
+    // entering a new slot at some level: cascade the slots above it
+    for(int level = 1; level < TW_LEVELS; level++){
+      if((wheel.now & ((1UL << (TW_BITS * level)) - 1)) != 0)
+        break;
+      wheel_cascade(level);
+    }
+
+    // every process in this level 0 slot is due, unless the slot is
+    // the one time is in now
+    for(p = wheel.slots[0][wheel.now & TW_MASK]; p; p = next){
+      next = p->timer_next;
+      if(p->wakeup_time <= time){
+        wheel_remove(p);
+        wake_up(&p->wakeup_time);
+      }
+    }
+    if(wheel.now == target)
+      break;
+
+    // skip ahead over stretches where nothing can happen: up to the
+    // next cascade of the lowest level that has any sleepers
+    int lowest = 0;
+    while(lowest < TW_LEVELS && wheel.count[lowest] == 0)
+      lowest++;
+    if(lowest == 0){
+      wheel.now++;
+    } else {
+      uint64 next_cascade = lowest < TW_LEVELS ?
+        ((wheel.now >> (TW_BITS * lowest)) + 1) << (TW_BITS * lowest) : target;
+      wheel.now = next_cascade < target ? next_cascade : target;
+    }
+  }
+  wheel_update_next();
+  release(&wheel.lock);
+}
+
+// earliest time anyone on the wheel may be due, or ~0 if it's empty.
+// called by timer_arm() without the lock; a stale value only costs an
+// early interrupt, or a late one that's fixed by the caller rearming
+// after its next timer_expire().
+uint64
+timer_next_expiry(void)
+{
+  return __atomic_load_n(&wheel.next_expiry, __ATOMIC_RELAXED);
+}
+
+// file p on the wheel under p->wakeup_time
+// caller holds wheel.lock
+static void
+wheel_insert(struct proc *p)
+{
+  uint64 expires = p->wakeup_time >> TW_SHIFT;
+  uint64 delta;
+  int level;
+
+  // overdue: the current slot, which timer_expire() looks at first
+  if(expires < wheel.now)
+    expires = wheel.now;
+  delta = expires - wheel.now;
+  for(level = 0; level < TW_LEVELS - 1; level++)
+    if(delta < (1UL << (TW_BITS * (level + 1))))
+      break;
+  // beyond the top level's reach: park in its farthest slot, and
+  // cascade back up there until the deadline is in range
+  if(delta >= (1UL << (TW_BITS * TW_LEVELS)))
+    expires = wheel.now + (1UL << (TW_BITS * TW_LEVELS)) - 1;
+
+  struct proc **slot = &wheel.slots[level][(expires >> (TW_BITS * level)) & TW_MASK];
+  p->timer_level = level;
+  p->timer_next = *slot;
+  if(*slot)
+    (*slot)->timer_pprev = &p->timer_next;
+  p->timer_pprev = slot;
+  *slot = p;
+  wheel.count[level]++;
+
+  if(p->wakeup_time < wheel.next_expiry)
+    wheel.next_expiry = p->wakeup_time;
+}
+
+// caller holds wheel.lock
+static void
+wheel_remove(struct proc *p)
+{
+  *p->timer_pprev = p->timer_next;
+  if(p->timer_next)
+    p->timer_next->timer_pprev = p->timer_pprev;
+  p->timer_next = 0;
+  p->timer_pprev = 0;
+  wheel.count[p->timer_level]--;
+}
+
+// refile the processes in the level slot that wheel.now just entered
+// caller holds wheel.lock
+static void
+wheel_cascade(int level)
+{
+  struct proc **slot = &wheel.slots[level][(wheel.now >> (TW_BITS * level)) & TW_MASK];
+  struct proc *p, *next;
+
+  p = *slot;
+  *slot = 0;
+  for(; p; p = next){
+    next = p->timer_next;
+    wheel.count[level]--;
+    wheel_insert(p);
+  }
+}
+
+// recompute wheel.next_expiry after timer_expire() moved the wheel:
+// the earliest deadline in the first non-empty level 0 slot, or the
+// next time a higher level cascades, whichever is sooner (a cascaded
+// process may be due before the ones already in level 0)
+// caller holds wheel.lock
+static void
+wheel_update_next(void)
+{
+  uint64 next = ~0UL;
+
+  if(wheel.count[0]){
+    for(int i = 0; i < TW_SLOTS; i++){
+      struct proc *p = wheel.slots[0][(wheel.now + i) & TW_MASK];
+      for(; p; p = p->timer_next)
+        if(p->wakeup_time < next)
+          next = p->wakeup_time;
+      if(next != ~0UL)
+        break;
+    }
+  }
+  for(int level = 1; level < TW_LEVELS; level++){
+    if(wheel.count[level]){
+      uint64 cascade = (((wheel.now >> (TW_BITS * level)) + 1) << (TW_BITS * level)) << TW_SHIFT;
+      if(cascade < next)
+        next = cascade;
+      break;
+    }
+  }
+  wheel.next_expiry = next;
+}
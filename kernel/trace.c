@@ -0,0 +1,174 @@
+// kernel event tracing
+//
+// when tracing is on, context switches, system calls, traps and disk
+// requests are recorded with the time csr in a ring buffer per cpu, to
+// be read through the trace device (/dev/trace) as struct trace_event
+// records. writing "1" to the device discards what's there and starts
+// tracing, and "0" stops it.
+// - only its own cpu writes to a ring, with interrupts off, so
+//   recording an event takes no lock; when a ring is full the oldest
+//   events are overwritten.
+// - each slot has a sequence number, zeroed while the event is being
+//   written and then set to its index + 1. a reader copies the event
+//   and checks the number again, as with a seqlock, so it never
+//   returns an event that was being overwritten as it read it.
+// - readers take trace.lock among themselves; writers never do.
+// a read returns each cpu's events in order, one cpu after another,
+// so the tool reading them merges the cpus by time.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "trace.h"
+#include "defs.h"
+
+#define NTRACE 1024   // events per cpu
+
+struct trace_slot {
+  uint64 seq;               // index of the event + 1, or 0 while it's written
+  struct trace_event ev;
+};
+
+struct trace_ring {
+  uint64 head;              // events ever recorded; written only by the ring's cpu
+  uint64 tail;              // events read, or skipped (under trace.lock)
+  struct trace_slot slots[NTRACE];
+};
+
+static struct {
+  struct spinlock lock;
+  int on;
+  struct trace_ring rings[NCPU];
+} trace;
+
+static int trace_read(int user_dst, uint64 dst, int n);
+static int trace_write(int user_src, uint64 src, int n);
+
+void
+trace_init(void)
+{
+  create_lock(&trace.lock, "trace");
+  device_drivers[TRACE].read = trace_read;
+  device_drivers[TRACE].write = trace_write;
+}
+
+// record an event on this cpu's ring, if tracing is on
+void
+trace_record(int type, int pid, uint64 arg)
+{
+  struct trace_ring *r;
+  struct trace_slot *s;
+  uint64 h;
+
+  if(__atomic_load_n(&trace.on, __ATOMIC_RELAXED) == 0)
+    return;
+
+  push_off();
+  r = &trace.rings[cpuid()];
+  h = r->head;
+  s = &r->slots[h % NTRACE];
+  __atomic_store_n(&s->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  s->ev.time = r_time();
+  s->ev.arg = arg;
+  s->ev.pid = pid;
+  s->ev.type = type;
+  s->ev.cpu = r - trace.rings;
+  __atomic_store_n(&s->seq, h + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+  pop_off();
+}
+
+// fill in e to tell the reader n events of ring r were lost
+static void
+trace_lost(struct trace_ring *r, struct trace_event *e, uint64 n)
+{
+  e->time = 0;
+  e->arg = n;
+  e->pid = 0;
+  e->type = TRACE_LOST;
+  e->cpu = r - trace.rings;
+}
+
+// take the oldest unread event off ring r into e.
+// returns 0 if there is none.
+// caller holds trace.lock
+static int
+trace_next(struct trace_ring *r, struct trace_event *e)
+{
+  struct trace_slot *s;
+  uint64 head, seq;
+
+  head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  if(r->tail == head)
+    return 0;
+  if(head - r->tail > NTRACE){
+    // lapped: tell the reader how many it missed
+    trace_lost(r, e, head - NTRACE - r->tail);
+    r->tail = head - NTRACE;
+    return 1;
+  }
+  s = &r->slots[r->tail % NTRACE];
+  seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+  *e = s->ev;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  r->tail++;
+  if(seq != r->tail || __atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq){
+    // overwritten as we read it. tail has moved past the slot, so
+    // the lapped check above won't count it: report it lost here
+    trace_lost(r, e, 1);
+  }
+  return 1;
+}
+
+// read whole events, up to n bytes of them, without waiting for more
+static int
+trace_read(int user_dst, uint64 dst, int n)
+{
+  struct trace_event ev[16];
+  int got = 0;
+
+  while(n - got >= sizeof(ev[0])){
+    int max = (n - got) / sizeof(ev[0]);
+    int k = 0;
+    if(max > NELEM(ev))
+      max = NELEM(ev);
+    acquire(&trace.lock);
+    for(int c = 0; c < NCPU && k < max; c++)
+      while(k < max && trace_next(&trace.rings[c], &ev[k]))
+        k++;
+    release(&trace.lock);
+    if(k == 0)
+      break;
+    if(either_copyout(user_dst, dst + got, ev, k * sizeof(ev[0])) < 0)
+      return got ? got : -1;
+    got += k * sizeof(ev[0]);
+  }
+  return got;
+}
+
+// "1" starts tracing afresh, "0" stops it
+static int
+trace_write(int user_src, uint64 src, int n)
+{
+  char c;
+
+  if(n < 1 || either_copyin(&c, user_src, src, 1) < 0)
+    return -1;
+  if(c != '0' && c != '1')
+    return -1;
+  acquire(&trace.lock);
+  if(c == '1'){
+    for(int i = 0; i < NCPU; i++)
+      trace.rings[i].tail = __atomic_load_n(&trace.rings[i].head, __ATOMIC_ACQUIRE);
+  }
+  __atomic_store_n(&trace.on, c == '1', __ATOMIC_RELEASE);
+  release(&trace.lock);
+  return n;
+}
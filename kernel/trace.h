@@ -0,0 +1,22 @@
+// kernel event tracing: the records read from the trace device
+// (see trace.c)
+
+#define TRACE_RUNNABLE    1  // pid was made RUNNABLE (woken, preempted or new)
+#define TRACE_RUN         2  // the cpu switched to pid
+#define TRACE_STOP        3  // pid gave the cpu back to the scheduler
+#define TRACE_SYSCALL     4  // pid entered system call arg
+#define TRACE_SYSRET      5  // ...and returned from it
+#define TRACE_TRAP        6  // interrupt or exception (not a system call), arg is scause
+#define TRACE_DISK_SUBMIT 7  // disk request for block arg, with TRACE_DISK_WRITE set for a write
+#define TRACE_DISK_DONE   8  // the disk finished the request for block arg
+#define TRACE_LOST        9  // the reader fell behind and arg events were overwritten
+
+#define TRACE_DISK_WRITE  (1UL << 63)
+
+struct trace_event {
+  uint64 time;    // time csr when it happened (0 for TRACE_LOST)
+  uint64 arg;
+  int pid;        // process it's about, or 0
+  short type;     // TRACE_
+  short cpu;      // cpu it happened on
+};
@@ -20,12 +20,15 @@
 #include "riscv.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "trace.h"
 #include "defs.h"
 
 struct spinlock tickslock;  // synchronizes access to timer tick counter across cpus
-uint ticks;       // global counter of timer interrupts since system started
+uint ticks;       // timer ticks since the system started; see update_ticks()
+static uint64 tick_origin;          // r_time() at boot, when ticks was 0
 
 extern char trampoline[], uservec[], userret[];  // assembly code in trampoline.S
+extern int use_asids;  // vm.c
 
 // in kernelvec.S, calls kerneltrap()
 void kernelvec();
@@ -40,6 +43,7 @@ void initialize_trap_system_globals(void)
   // initialize the lock that protects the global timer tick counter
   // this lock prevents race conditions when multiple cpus access timer_ticks_since_boot
   create_lock(&tickslock, "time");
+  tick_origin = r_time();
 }
 
 // configure this cpu core to handle traps and exceptions while running kernel code
@@ -52,6 +56,9 @@ void install_kernel_trap_vector_on_cpu(void)
   // when a trap occurs while cpu is in supervisor mode, hardware jumps to kernelvec
   // kernelvec is defined in kernelvec.S and handles kernel-mode interrupts/exceptions
   w_stvec((uint64)kernelvec);
+
+  // how long a process may run before this cpu's timer preempts it
+  mycpu()->quantum = QUANTUM_CYCLES;
 }
 
 // handle an interrupt, exception, or system call from user space
@@ -72,11 +79,19 @@ void usertrap(void)
   w_stvec((uint64)kernelvec);
 
   struct proc *current_process = myproc();
+
+  // no longer running in user space, so no stale TLB entries of ours
+  // are in use (see tlb_shootdown())
+  __atomic_add_fetch(&current_process->user_seq, 1, __ATOMIC_SEQ_CST);
   
   // preserve user program counter for eventual return to user space
   // sepc (supervisor exception program counter) contains user pc at trap time
   // we save this in trapframe so we can restore it when returning to user
   current_process->trapframe->epc = r_sepc();
+  if(r_scause() != 8)
+    trace_record(TRACE_TRAP, current_process->pid, r_scause());
+  if(r_scause() == 12 || r_scause() == 13 || r_scause() == 15)
+    current_process->ru.nfault++;
   
   // decode trap cause by examining scause register (supervisor cause register)
   // scause contains a code indicating what type of trap occurred
@@ -100,6 +115,12 @@ void usertrap(void)
     // dispatch to appropriate system call handler based on call number
     // system call number is passed in a7 register (saved in trapframe by trampoline.S)
     syscall();
+  } else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+            vmfault(current_process->pagetable, r_stval(),
+                    r_scause() == 12 ? PTE_X : r_scause() == 13 ? PTE_R : PTE_W) == 0){
+    // instruction/load/store page fault on a not-yet-read program page,
+    // a lazily allocated heap page or a store to a copy-on-write page -
+    // vmfault() mapped the page, so just retry
   } else if((device_interrupt_type = devintr()) != 0){
     // external device interrupt (timer, disk, uart, network, etc.)
     // devintr() examines interrupt controller and handles the specific device
@@ -118,10 +139,11 @@ void usertrap(void)
     exit(-1);
 
   // implement preemptive scheduling via timer interrupts
-  // if this was a timer interrupt (device_interrupt_type == 2), yield cpu to next process
+  // if this was a timer interrupt (device_interrupt_type == 2), let the scheduling
+  // policy decide whether to yield cpu to next process
   // this ensures no process can monopolize the cpu indefinitely
   if(device_interrupt_type == 2)
-    yield();
+    sched_tick();
 
   // prepare for return to user space
   // this sets up registers and switches back to user mode
@@ -152,6 +174,7 @@ void usertrapret(void)
   current_process->trapframe->kernel_sp = current_process->kstack + PGSIZE; // top of kernel stack
   current_process->trapframe->kernel_trap = (uint64)usertrap; // kernel trap handler address
   current_process->trapframe->kernel_hartid = r_tp();         // current cpu core id
+  current_process->trapframe->kernel_flush_tlb = !use_asids;  // trampoline must flush the whole TLB
 
   // configure supervisor status register for return to user mode
   // sstatus controls privilege level and interrupt state after sret instruction
@@ -165,15 +188,30 @@ void usertrapret(void)
   w_sepc(current_process->trapframe->epc);
 
   // create satp register value for user process page table
-  // MAKE_SATP converts process page table physical address to satp format
+  // MAKE_SATP_ASID converts process page table physical address to satp format,
+  // tagged with the process's asid so its TLB entries survive switches to the
+  // kernel and to other processes. they only need flushing if this cpu was
+  // told the process's mappings changed since it last ran here.
   // trampoline code will load this to switch from kernel to user virtual memory
-  uint64 user_page_table_satp = MAKE_SATP(current_process->pagetable);
+  uint64 user_page_table_satp = MAKE_SATP_ASID(current_process->pagetable, current_process->asid);
+  // say we're in user space before looking at tlb_stale: a thread that
+  // changes the page table marks us stale first and then checks whether
+  // it must wait for us to come back into the kernel
+  __atomic_add_fetch(&current_process->user_seq, 1, __ATOMIC_SEQ_CST);
+  if(use_asids){
+    uint mask = 1U << cpuid();
+    if(__atomic_load_n(&current_process->tlb_stale, __ATOMIC_SEQ_CST) & mask){
+      __atomic_fetch_and(&current_process->tlb_stale, ~mask, __ATOMIC_SEQ_CST);
+      sfence_vma_asid(current_process->asid);
+    }
+  }
 
   // execute the actual return to user space via trampoline code
   // trampoline.S:userret switches page tables, restores registers, executes sret
   // userret function is position-independent and works from any page table
   uint64 trampoline_userret_address = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64))trampoline_userret_address)(user_page_table_satp);
+  ((void (*)(uint64, uint64, uint64))trampoline_userret_address)(user_page_table_satp, !use_asids,
+                                                               current_process->trapframe_va);
 }
 
 // handle interrupts and exceptions that occur while running kernel code
@@ -197,6 +235,8 @@ kerneltrap()
   if(intr_get() != 0)
     panic("kerneltrap: interrupts enabled");
 
+  trace_record(TRACE_TRAP, 0, supervisor_cause_register);
+
   // attempt to handle this as a device interrupt
   // if devintr returns 0, this is an unexpected trap/exception
   if((device_interrupt_type = devintr()) == 0){
@@ -207,10 +247,10 @@ kerneltrap()
   }
 
   // implement preemptive scheduling for kernel code
-  // if this was a timer interrupt and we have a current process, yield cpu
+  // if this was a timer interrupt and we have a current process, maybe yield cpu
   // allows other processes to run even if kernel is in a long-running operation
   if(device_interrupt_type == 2 && myproc() != 0)
-    yield();
+    sched_tick();
 
   // restore trap registers to their original values
   // yield() may have caused context switches and other traps to occur
@@ -219,25 +259,75 @@ kerneltrap()
   w_sstatus(saved_supervisor_status);
 }
 
+// bring ticks up to date with the time csr.
+// ticks is derived from the time rather than counted by one cpu's
+// timer interrupts, so any cpu can advance it, and it's still right
+// after every cpu has sat idle with its timer off.
+// caller holds tickslock
+void
+update_ticks(void)
+{
+  ticks = (r_time() - tick_origin) / TICK_CYCLES;
+}
+
+// the value of the time csr when ticks reaches t
+uint64
+tick_time(uint t)
+{
+  return tick_origin + (uint64)t * TICK_CYCLES;
+}
+
+// program this cpu's timer for its next interrupt. a cpu running a
+// process is interrupted after its quantum, so that the process can be
+// preempted; an idle cpu (tickless) only when the next sleeper on the
+// timer wheel is due, or never. either way no later than that, since
+// there may be no other cpu awake to notice it.
+// this also clears a pending timer interrupt request.
+// interrupts must be off
+void
+timer_arm(int idle)
+{
+  uint64 when = idle ? ~0UL : r_time() + mycpu()->quantum;
+  uint64 due = timer_next_expiry();
+
+  if(due < when)
+    when = due;
+  w_stimecmp(when);
+}
+
 // handle timer/clock interrupts for timekeeping and scheduling
 // called by device interrupt handler when timer fires
 // maintains global tick counter and wakes up sleeping processes
 void
 clockintr()
 {
-  // only cpu 0 maintains the global timer tick counter to avoid races
-  // other cpus can handle timer interrupts but don't update global state
-  if(cpuid() == 0){
+  // wake the sleepers that are due
+  timer_expire();
+
+  // every cpu's timer interrupt keeps ticks current; skip the lock
+  // when a tick hasn't passed since the last cpu looked
+  if((r_time() - tick_origin) / TICK_CYCLES != __atomic_load_n(&ticks, __ATOMIC_RELAXED)){
+#ifdef SCHED_MLFQ
+    static uint last_boost;
+    int boost = 0;
+#endif
     acquire(&tickslock);
-    ticks++;  // increment global time counter
-    wake_up(&ticks);  // wake processes sleeping on timer
+    update_ticks();
+#ifdef SCHED_MLFQ
+    if(ticks - last_boost >= MLFQ_BOOST_TICKS){
+      last_boost = ticks;
+      boost = 1;
+    }
+#endif
     release(&tickslock);
+#ifdef SCHED_MLFQ
+    if(boost)
+      mlfq_boost();
+#endif
   }
 
-  // ask for the next timer interrupt. this also clears
-  // the interrupt request. 1000000 is about a tenth
-  // of a second.
-  w_stimecmp(r_time() + 1000000);
+  // ask for the next timer interrupt
+  timer_arm(mycpu()->proc == 0);
 }
 
 // check if it's an external interrupt or software interrupt,
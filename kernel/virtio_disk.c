@@ -4,6 +4,12 @@
 //
 // qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
 //
+// virtio_disk_rw() reads or writes one buf and waits for it.
+// virtio_disk_rwv() and virtio_disk_start() hand the device a batch
+// of bufs with one notify, so it can have NUM/3 requests in flight;
+// the first waits for them all, the second returns at once and has
+// virtio_disk_intr() call back as each finishes.
+//
 
 #include "types.h"
 #include "riscv.h"
@@ -15,6 +21,7 @@
 #include "fs.h"
 #include "buf.h"
 #include "virtio.h"
+#include "trace.h"
 
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
@@ -48,6 +55,8 @@ static struct disk {
   struct {
     struct buf *b;
     char status;
+    void (*done)(struct buf *);  // called when the request finishes, or 0
+                                 // if someone sleeps on b instead
   } info[NUM];
 
   // disk command headers.
@@ -212,26 +221,18 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// format the three descriptors idx for a request to read or
+// write b, and put it on the avail ring. the device doesn't look
+// until it's notified. caller holds vdisk_lock.
+static void
+queue(struct buf *b, int write, int *idx, void (*done)(struct buf *))
 {
   uint64 sector = b->blockno * (BSIZE / 512);
 
-  acquire(&disk.vdisk_lock);
-
   // the spec's Section 5.2 says that legacy block operations use
   // three descriptors: one for type/reserved/sector, one for the
   // data, one for a 1-byte status result.
 
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
-  }
-
   // format the three descriptors.
   // qemu's virtio-blk.c reads them.
 
@@ -267,6 +268,7 @@ virtio_disk_rw(struct buf *b, int write)
   // record struct buf for virtio_disk_intr().
   b->disk = 1;
   disk.info[idx[0]].b = b;
+  disk.info[idx[0]].done = done;
 
   // tell the device the first index in our chain of descriptors.
   disk.avail->ring[disk.avail->idx % NUM] = idx[0];
@@ -276,24 +278,95 @@ virtio_disk_rw(struct buf *b, int write)
   // tell the device another avail ring entry is available.
   disk.avail->idx += 1; // not % NUM ...
 
+  trace_record(TRACE_DISK_SUBMIT, 0, b->blockno | (write ? TRACE_DISK_WRITE : 0));
+}
+
+// tell the device about the requests queued since last time.
+static void
+notify(void)
+{
   __sync_synchronize();
 
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+}
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+// queue requests to read or write each of n bufs, and notify
+// the device once for all of them, so it can work on them
+// together. if the descriptors run out, either wait for some
+// to be freed (wait set) or stop. returns how many were queued.
+// caller holds vdisk_lock.
+static int
+submit(struct buf **bufs, int n, int write, void (*done)(struct buf *), int wait)
+{
+  int idx[3];
+  int i, queued = 0;
+
+  for(i = 0; i < n; i++){
+    while(alloc3_desc(idx) < 0){
+      if(!wait)
+        goto out;
+      // let the device start on what we have while we wait
+      if(queued){
+        notify();
+        queued = 0;
+      }
+      sleep(&disk.free[0], &disk.vdisk_lock);
+    }
+    queue(bufs[i], write, idx, done);
+    queued++;
   }
+out:
+  if(queued)
+    notify();
+  return i;
+}
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_rwv(&b, 1, write);
+}
+
+// read or write n bufs, with as many requests in flight
+// at once as the ring holds, and wait for them all.
+void
+virtio_disk_rwv(struct buf **bufs, int n, int write)
+{
+  acquire(&disk.vdisk_lock);
+
+  submit(bufs, n, write, 0, 1);
+
+  // Wait for virtio_disk_intr() to say the requests have finished.
+  for(int i = 0; i < n; i++){
+    while(bufs[i]->disk == 1) {
+      sleep(bufs[i], &disk.vdisk_lock);
+    }
+  }
 
   release(&disk.vdisk_lock);
 }
 
+// start reading or writing n bufs and return without waiting.
+// as each request finishes, virtio_disk_intr() calls done(b).
+// only starts as many as there are free descriptors for;
+// returns how many, always the first ones.
+int
+virtio_disk_start(struct buf **bufs, int n, int write, void (*done)(struct buf *))
+{
+  acquire(&disk.vdisk_lock);
+  n = submit(bufs, n, write, done, 0);
+  release(&disk.vdisk_lock);
+  return n;
+}
+
 void
 virtio_disk_intr()
 {
+  // chains of finished requests with a callback; each chain holds
+  // three descriptors, so at most NUM/3 are in flight.
+  uchar done[NUM/3];
+  int ndone = 0;
+
   acquire(&disk.vdisk_lock);
 
   // the device won't raise another interrupt until we tell it
@@ -318,10 +391,33 @@ virtio_disk_intr()
 
     struct buf *b = disk.info[id].b;
     b->disk = 0;   // disk is done with buf
-    wake_up(b);
+    trace_record(TRACE_DISK_DONE, 0, b->blockno);
+    if(disk.info[id].done){
+      // keep the chain, and so info[id], until the callback has run
+      done[ndone++] = id;
+    } else {
+      wake_up(b);
+      disk.info[id].b = 0;
+      free_chain(id);
+    }
 
     disk.used_idx += 1;
   }
 
   release(&disk.vdisk_lock);
+
+  if(ndone == 0)
+    return;
+
+  // the callbacks may take other locks (the buffer cache's,
+  // for read-ahead), so call them without ours
+  for(int i = 0; i < ndone; i++)
+    disk.info[done[i]].done(disk.info[done[i]].b);
+
+  acquire(&disk.vdisk_lock);
+  for(int i = 0; i < ndone; i++){
+    disk.info[done[i]].b = 0;
+    free_chain(done[i]);
+  }
+  release(&disk.vdisk_lock);
 }
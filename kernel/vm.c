@@ -19,16 +19,29 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "sleeplock.h"
+#include "file.h"
 
 // the kernel's page table - maps kernel virtual addresses to physical addresses
 // kernel runs in virtual memory just like user processes
 pagetable_t kernel_pagetable;
+
+int use_asids;  // each process runs under its own asid; see enable_kernel_virtual_memory_on_cpu()
+
+extern struct proc proc[NPROC];
 // 512 PTEs
 
 // linker symbols marking sections of kernel binary
 extern char etext[];  // kernel.ld sets this to end of kernel code.
 extern char trampoline[]; // trampoline.S - assembly code for kernel entry/exit
 
+static int map_pages(pagetable_t, uint64, uint64, uint64, int, int);
+static int vmfault_mapped(struct proc *, pagetable_t, uint64, int);
+static int uvmunshare_range(struct proc *, uint64, uint64);
+static pte_t * walk_to_level(pagetable_t, uint64, int, int);
+
 // create a direct-map page table for the kernel
 // "direct-map" means virtual address = physical address for most mappings
 // this simplifies kernel memory management
@@ -38,8 +51,7 @@ pagetable_t create_kernel_page_table(void)
 
   // allocate a physical page to hold the root page table
   // page table is just an array of 512 64-bit entries (4KB total)
-  kernel_root_page_table = (pagetable_t) kalloc();
-  memset(kernel_root_page_table, 0, PGSIZE); // clear all entries (invalid by default)
+  kernel_root_page_table = (pagetable_t) kalloc_zeroed(); // all entries start invalid
 
 
   // set up kernel mappings for memory-mapped devices
@@ -78,11 +90,38 @@ pagetable_t create_kernel_page_table(void)
 
 
 
+// count the page-table pages in the tree rooted at pagetable,
+// and the megapage leaves it holds
+static int count_page_table_pages(pagetable_t pagetable, int *megapages, int level)
+{
+  int n = 1;
+
+  for(int i = 0; i < 512; i++){
+    pte_t pte = pagetable[i];
+    if((pte & PTE_V) == 0)
+      continue;
+    if(pte & (PTE_R|PTE_W|PTE_X)){
+      if(level == 1)
+        (*megapages)++;
+    } else {
+      n += count_page_table_pages((pagetable_t)PTE2PA(pte), megapages, level - 1);
+    }
+  }
+  return n;
+}
+
 // initialize the kernel page table
 // called once during kernel startup
 void initialize_kernel_virtual_memory(void)
 {
+  int megapages = 0, pages;
+
   kernel_pagetable = create_kernel_page_table();
+
+  // each megapage leaf stands in for a whole level-0 table of 4KB leaves
+  pages = count_page_table_pages(kernel_pagetable, &megapages, 2);
+  printf("kernel page table: %d pages, %d megapages (%d pages with 4KB leaves only)\n",
+         pages, megapages, pages + megapages);
 }
 
 
@@ -106,6 +145,40 @@ void enable_kernel_virtual_memory_on_cpu()
   // TLB caches recent virtual-to-physical address translations
   // must flush when changing page tables
   sfence_vma();
+
+  // the satp asid field is WARL: writing all ones and reading it back
+  // gives the largest asid the hardware implements. every process needs
+  // one of its own (1..NPROC), otherwise usertrapret() and trampoline.S
+  // fall back to flushing the whole TLB on every switch.
+  // all harts are assumed to be alike, so only hart 0 checks.
+  if(cpuid() == 0){
+    write_supervisor_address_translation_and_protection_register(MAKE_SATP(kernel_pagetable) | SATP_ASID_MASK);
+    uint64 max_asid = (r_satp() & SATP_ASID_MASK) >> SATP_ASID_SHIFT;
+    write_supervisor_address_translation_and_protection_register(MAKE_SATP(kernel_pagetable));
+    sfence_vma();
+    use_asids = max_asid >= NPROC;
+  }
+}
+
+// note that the user mappings in pagetable changed.
+// if it's the current process's, every cpu must flush the process's
+// asid before running it again (usertrapret() does this); other page
+// tables aren't loaded anywhere, so there's nothing to flush.
+// each of a process's threads has an asid of its own.
+void
+uvmflush(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+
+  if(p == 0 || p->pagetable != pagetable)
+    return;
+  if(p->group->nthreads == 1){
+    __atomic_store_n(&p->tlb_stale, ~0U, __ATOMIC_SEQ_CST);
+    return;
+  }
+  for(struct proc *t = proc; t < &proc[NPROC]; t++)
+    if(t->pagetable == pagetable)
+      __atomic_store_n(&t->tlb_stale, ~0U, __ATOMIC_SEQ_CST);
 }
 
 // return the address of the PTE in page table pagetable
@@ -128,6 +201,16 @@ void enable_kernel_virtual_memory_on_cpu()
 // - PX(1, va): (0x123456789 >> 21) & 0x1FF = 0x91A2 & 0x1FF = 0x1A2
 // - PX(0, va): (0x123456789 >> 12) & 0x1FF = 0x1234560F1 & 0x1FF = 0x0F1
 pte_t * walk_page_table(pagetable_t page_table_root, uint64 virtual_address, int should_allocate_missing_tables)
+{
+  return walk_to_level(page_table_root, virtual_address, should_allocate_missing_tables, 0);
+}
+
+// like walk_page_table(), but stop at the PTE for va in the level
+// leaf_level page-table page (1 to place a megapage leaf there).
+// a megapage leaf met on the way down is returned as is, so callers
+// that expect a level-0 PTE must check PTE_R|PTE_W|PTE_X on it -
+// only the kernel's direct map uses megapages.
+static pte_t * walk_to_level(pagetable_t page_table_root, uint64 virtual_address, int should_allocate_missing_tables, int leaf_level)
 {
 
   // check if virtual address is within valid range
@@ -137,7 +220,7 @@ pte_t * walk_page_table(pagetable_t page_table_root, uint64 virtual_address, int
   
   // walk down the 3-level page table hierarchy
   // start at level 2 (root), walk down to level 0 (leaf)
-  for(int current_page_table_level = 2; current_page_table_level > 0; current_page_table_level--) {
+  for(int current_page_table_level = 2; current_page_table_level > leaf_level; current_page_table_level--) {
     // get pointer to page table entry for this level
     // PX() extracts the appropriate 9-bit index from virtual address
     // remember that page_table_root is a array of PTEs always -> int64 pointers
@@ -147,7 +230,11 @@ pte_t * walk_page_table(pagetable_t page_table_root, uint64 virtual_address, int
     pte_t* current_level_page_table_entry = &page_table_root[PX(current_page_table_level, virtual_address)];
     
     // check actual value of PTE (64 bits)
-    if(*current_level_page_table_entry & PTE_V) {
+    if((*current_level_page_table_entry & PTE_V) &&
+       (*current_level_page_table_entry & (PTE_R|PTE_W|PTE_X))) {
+      // a megapage leaf - there is no lower-level table to walk into
+      return current_level_page_table_entry;
+    } else if(*current_level_page_table_entry & PTE_V) {
       // page table entry is valid - extract physical address of next level
       // PTE2PA extracts physical addr bits
       // get the physical addr of the NEXT page table
@@ -155,13 +242,10 @@ pte_t * walk_page_table(pagetable_t page_table_root, uint64 virtual_address, int
     } 
     else {
       // page table entry is invalid - signal that w need to allocate new page table
-      if(!should_allocate_missing_tables || (page_table_root = (pde_t*)kalloc()) == 0){
-        printf("not allocating page table bcz invalid entry");
+      // new page table comes back zeroed (all entries start invalid)
+      // (not-yet-mapped lazy pages make a missing table normal, so don't complain)
+      if(!should_allocate_missing_tables || (page_table_root = (pde_t*)kalloc_zeroed()) == 0)
         return 0; // allocation failed or not requested
-      }
-        
-      // clear new page table (all entries start invalid)
-      memset(page_table_root, 0, PGSIZE);
 
       // install physical address of new page table in current page table entry
       // set valid bit to make this entry active
@@ -169,8 +253,8 @@ pte_t * walk_page_table(pagetable_t page_table_root, uint64 virtual_address, int
     }
   }
   
-  // return pointer to final level-0 page table entry that maps the virtual address (pointer meaning pointer to a 64 bit PTE)
-  return &page_table_root[PX(0, virtual_address)];
+  // return pointer to the level leaf_level (normally level-0) page table entry that maps the virtual address (pointer meaning pointer to a 64 bit PTE)
+  return &page_table_root[PX(leaf_level, virtual_address)];
 }
 
 // Look up a virtual address, return the physical address,
@@ -198,10 +282,11 @@ walkaddr(pagetable_t pagetable, uint64 va)
 
 // add a mapping to the kernel page table
 // only used when booting
+// 2MB-aligned stretches are mapped with megapage leaves
 // does not flush TLB or enable paging
 void map_kernel_virtual_to_physical(pagetable_t kernel_page_table, uint64 virtual_address, uint64 physical_address, uint64 mapping_size, int page_permissions)
 {
-  if(create_page_table_mappings(kernel_page_table, virtual_address, mapping_size, physical_address, page_permissions) != 0)
+  if(map_pages(kernel_page_table, virtual_address, mapping_size, physical_address, page_permissions, 1) != 0)
     panic("map_kernel_virtual_to_physical");
 }
 
@@ -211,7 +296,19 @@ void map_kernel_virtual_to_physical(pagetable_t kernel_page_table, uint64 virtua
 // x
 int create_page_table_mappings(pagetable_t page_table, uint64 virtual_address_start, uint64 total_mapping_size, uint64 physical_address_start, int page_permissions)
 {
-  uint64 current_virtual_address, last_virtual_address;
+  // user page tables always use 4KB leaves; uvmunmap() and friends rely on it
+  if(map_pages(page_table, virtual_address_start, total_mapping_size, physical_address_start, page_permissions, 0) != 0)
+    return -1;
+  // the hardware is allowed to cache invalid entries too
+  uvmflush(page_table);
+  return 0;
+}
+
+// create_page_table_mappings(), optionally using a level-1 megapage leaf
+// wherever va and pa are both 2MB-aligned and at least 2MB remain
+static int map_pages(pagetable_t page_table, uint64 virtual_address_start, uint64 total_mapping_size, uint64 physical_address_start, int page_permissions, int use_megapages)
+{
+  uint64 current_virtual_address, last_virtual_address, step;
   pte_t *current_page_table_entry;
 
   if((virtual_address_start % PGSIZE) != 0)
@@ -228,9 +325,17 @@ int create_page_table_mappings(pagetable_t page_table, uint64 virtual_address_st
   
   // iterate through each page in the mapping range
   while(1) {
+    // a whole aligned 2MB left to map - one level-1 leaf covers it
+    step = PGSIZE;
+    if(use_megapages &&
+       (current_virtual_address % MEGAPGSIZE) == 0 &&
+       (physical_address_start % MEGAPGSIZE) == 0 &&
+       last_virtual_address - current_virtual_address >= MEGAPGSIZE - PGSIZE)
+      step = MEGAPGSIZE;
+
     // find the page table entry for this virtual address
     // allocate intermediate page tables if needed (parameter 1 means allocate)
-    current_page_table_entry = walk_page_table(page_table, current_virtual_address, 1);
+    current_page_table_entry = walk_to_level(page_table, current_virtual_address, 1, step == MEGAPGSIZE);
     if(current_page_table_entry == 0) {
       return -1; // if walk couldn't allocate needed page tables, return error
     }
@@ -246,20 +351,21 @@ int create_page_table_mappings(pagetable_t page_table, uint64 virtual_address_st
     *current_page_table_entry = PA2PTE(physical_address_start) | page_permissions | PTE_V;
     
     // check if we've mapped all requested pages
-    if(current_virtual_address == last_virtual_address) {
+    if(current_virtual_address + step - PGSIZE == last_virtual_address) {
       break; // finished mapping all pages
     }
     
     // advance to next page
-    current_virtual_address += PGSIZE;  // move to next 4KB virtual page
-    physical_address_start += PGSIZE;   // move to next 4KB physical page
+    current_virtual_address += step;  // move to next 4KB (or 2MB) virtual page
+    physical_address_start += step;   // move to next 4KB (or 2MB) physical page
     // even though these are incremented by the same, these are NOT guruanteed to be next to eachother
   }
   return 0;
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never faulted in (lazy
+// sbrk) have no mapping and are skipped.
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
@@ -272,9 +378,9 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
     if((pte = walk_page_table(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+      continue;
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
@@ -283,6 +389,74 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
     }
     *pte = 0;
   }
+  uvmflush(pagetable);
+}
+
+// uvmunmap(p->pagetable, va, npages, 1) for the current process p,
+// whose other threads may be running on other cpus with the pages in
+// their TLBs: the pages are only freed once tlb_shootdown() says none
+// of them can still reach them.
+// the caller has already taken the range out of p->group's sz or
+// vmas, so no fault can map it again meanwhile.
+void
+uvmunmap_user(struct proc *p, uint64 va, uint64 npages)
+{
+  struct proc *g = p->group;
+  uint64 end = va + npages*PGSIZE;
+  uint64 pa[32];
+  pte_t *pte;
+  int n;
+
+  if((va % PGSIZE) != 0)
+    panic("uvmunmap_user: not aligned");
+
+  while(va < end){
+    n = 0;
+    acquire(&g->group_lock);
+    for(; va < end && n < NELEM(pa); va += PGSIZE){
+      if((pte = walk_page_table(p->pagetable, va, 0)) == 0)
+        continue;
+      if((*pte & PTE_V) == 0)
+        continue;
+      if(PTE_FLAGS(*pte) == PTE_V)
+        panic("uvmunmap_user: not a leaf");
+      pa[n++] = PTE2PA(*pte);
+      *pte = 0;
+    }
+    uvmflush(p->pagetable);
+    release(&g->group_lock);
+    if(n == 0)
+      continue;
+    tlb_shootdown(p);
+    for(int i = 0; i < n; i++)
+      kernel_free_page((void*)pa[i]);
+  }
+}
+
+// map the fresh page mem at va in the current process p's page table,
+// for a page fault. another thread of p may have faulted the page in
+// first, in which case mem isn't needed; or unmapped the range, in
+// which case the fault fails. either way mem is freed if not used.
+// returns 0 if the page is now mapped, -1 if not.
+int
+uvminstall(struct proc *p, uint64 va, char *mem, int perm)
+{
+  struct proc *g = p->group;
+  pte_t *pte;
+  int r = 0;
+
+  acquire(&g->group_lock);
+  if(va >= g->sz && mmap_lookup(p, va) == 0){
+    kernel_free_page(mem);
+    r = -1;
+  } else if((pte = walk_page_table(p->pagetable, va, 0)) != 0 && (*pte & PTE_V)){
+    kernel_free_page(mem);
+  } else if(create_page_table_mappings(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    kernel_free_page(mem);
+    r = -1;
+  }
+  release(&g->group_lock);
+  return r;
 }
 
 // create an empty user page table.
@@ -291,10 +465,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -308,8 +481,7 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("uvmfirst: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   create_page_table_mappings(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -327,12 +499,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(create_page_table_mappings(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kernel_free_page(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -392,40 +563,303 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Copies the page table but shares the physical
+// memory copy-on-write: writable pages become
+// read-only PTE_COW pages in both tables, and
+// vmfault() copies a page on the first store to it.
+// mode is UVM_COPY instead if the parent has
+// threads (see uvmunshare()).
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
-uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+uvmcopy(pagetable_t old, pagetable_t new, uint64 sz, int mode)
+{
+  return uvmcopyrange(old, new, 0, sz, mode);
+}
+
+// uvmcopy() for the page-aligned range [start, end).
+// mode says what happens to writable pages:
+// UVM_COW shares them copy-on-write, UVM_SHARE
+// shares them outright (for MAP_SHARED mappings),
+// and UVM_COPY gives new its own copies right away,
+// leaving old's PTEs alone.
+int
+uvmcopyrange(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int mode)
 {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
   char *mem;
 
-  for(i = 0; i < sz; i += PGSIZE){
+  for(i = start; i < end; i += PGSIZE){
+    // pages the parent never touched stay lazy in the child too
     if((pte = walk_page_table(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
+      continue;
     if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      continue;
     pa = PTE2PA(*pte);
+    if((*pte & PTE_W) && mode == UVM_COPY){
+      if((mem = kalloc()) == 0)
+        goto err;
+      memmove(mem, (char*)pa, PGSIZE);
+      if(create_page_table_mappings(new, i, PGSIZE, (uint64)mem, PTE_FLAGS(*pte)) != 0){
+        kernel_free_page(mem);
+        goto err;
+      }
+      continue;
+    }
+    if((*pte & PTE_W) && mode == UVM_COW)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if(create_page_table_mappings(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(create_page_table_mappings(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kernel_free_page(mem);
-      goto err;
-    }
+    kpage_ref((void*)pa);
   }
+  // the parent may still have the old writable PTEs cached
+  uvmflush(old);
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
   return -1;
 }
 
+// page in the page at va of exec segment seg from p's
+// executable. bytes past the segment's file size are zero.
+// returns 0 on success, -1 on error.
+static int
+execfault(struct proc *p, struct execseg *seg, uint64 va)
+{
+  struct inode *ip = p->group->exec_ip;
+  uint64 segoff = va - seg->va;
+  uint n = 0, bn, last;
+  char *mem;
+
+  // reading the inode sleeps; and if this fault came from
+  // copying to/from this very file, we'd deadlock on its lock
+  if(holding_spinlocks() || holdingsleep(&ip->lock))
+    return -1;
+
+  if((mem = kalloc_zeroed()) == 0)
+    return -1;
+  if(segoff < seg->filesz){
+    n = seg->filesz - segoff;
+    if(n > PGSIZE)
+      n = PGSIZE;
+    ilock(ip);
+    // a program is mostly paged in front to back: have the disk work
+    // on this page's blocks and the next NREADAHEAD of the segment
+    // together, rather than one at a time in readi()
+    bn = (seg->off + segoff) / BSIZE;
+    last = (seg->off + segoff + n - 1) / BSIZE + NREADAHEAD;
+    if(last > (seg->off + seg->filesz - 1) / BSIZE)
+      last = (seg->off + seg->filesz - 1) / BSIZE;
+    readahead(ip, bn, last - bn + 1);
+    if(readi(ip, 0, (uint64)mem, seg->off + segoff, n) != n){
+      iunlock(ip);
+      kernel_free_page(mem);
+      return -1;
+    }
+    iunlock(ip);
+  }
+  return uvminstall(p, va, mem, PTE_R|PTE_U|seg->perm);
+}
+
+// would faulting in unmapped page va of p read it from a file
+// (an exec segment or a file mapping), and so sleep?
+static int
+faultsleeps(struct proc *p, uint64 va)
+{
+  struct proc *g = p->group;
+  struct vma *v;
+  int r = 0;
+
+  acquire(&g->group_lock);
+  if((v = mmap_lookup(p, va)) != 0){
+    r = v->file != 0;
+  } else {
+    for(int i = 0; i < g->nexecseg; i++)
+      if(va >= g->execseg[i].va && va < g->execseg[i].va + g->execseg[i].memsz)
+        r = 1;
+  }
+  release(&g->group_lock);
+  return r;
+}
+
+// fault in the not-yet-mapped pages of the current process in
+// [va, va+len) that would have to be read from a file, so that a
+// following copyin()/copyout() made while holding a spinlock
+// doesn't need to sleep. heap and anonymous pages are left for
+// the copy to fault in, so that a big buffer only gets the pages
+// the copy actually reaches. errors are left for the copy to report.
+void
+uvmprefault(pagetable_t pagetable, uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+
+  if(len == 0 || va >= MAXVA || p == 0 || pagetable != p->pagetable)
+    return;
+  for(uint64 a = PGROUNDDOWN(va); a < va + len && a < MAXVA; a += PGSIZE){
+    pte = walk_page_table(pagetable, a, 0);
+    if((pte == 0 || (*pte & PTE_V) == 0) && faultsleeps(p, a))
+      if(vmfault(pagetable, a, PTE_R) != 0)
+        return;
+  }
+}
+
+// handle a page fault at user virtual address va.
+// access is the kind of access that faulted: PTE_R for a
+// load, PTE_W for a store, PTE_X for an instruction fetch.
+// - an unmapped address in one of the current process's
+//   exec segments is read in from the executable; this
+//   sleeps, so it fails if the caller holds a spinlock
+//   (see uvmprefault()).
+// - an address in an mmap() region goes to mmap_fault().
+// - any other unmapped address below the current process's
+//   sz is heap that sbrk() reserved lazily: map a zeroed page.
+// - a store to a PTE_COW page gets its own copy of the page
+//   (or just its write permission back, if no other page
+//   table still shares it).
+// - an access the PTE already allows was a stale TLB entry:
+//   another thread of the process has just mapped the page.
+// returns 0 if the fault was handled and the access can be
+// retried, -1 if va is not a valid address for the access.
+int
+vmfault(pagetable_t pagetable, uint64 va, int access)
+{
+  struct proc *p = myproc();
+  struct proc *g;
+  struct vma *v;
+  pte_t *pte;
+  char *mem;
+  int r;
+
+  if(va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+  pte = walk_page_table(pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0){
+    // only the current process's own memory is lazy
+    if(p == 0 || pagetable != p->pagetable)
+      return -1;
+    g = p->group;
+    if((v = mmap_lookup(p, va)) != 0)
+      return mmap_fault(p, v, va, access);
+    // another thread's sbrk() may be trimming the exec
+    // segments; work from a copy of the one va is in
+    acquire(&g->group_lock);
+    if(va >= g->sz){
+      release(&g->group_lock);
+      return -1;
+    }
+    for(int i = 0; i < g->nexecseg; i++){
+      struct execseg seg = g->execseg[i];
+      if(va >= seg.va && va < seg.va + seg.memsz){
+        release(&g->group_lock);
+        return execfault(p, &seg, va);
+      }
+    }
+    release(&g->group_lock);
+    if((mem = kalloc_zeroed()) == 0)
+      return -1;
+    return uvminstall(p, va, mem, PTE_R|PTE_W|PTE_U);
+  }
+
+  // the current process's other threads may be changing this PTE too
+  if(p == 0 || pagetable != p->pagetable)
+    return vmfault_mapped(p, pagetable, va, access);
+  acquire(&p->group->group_lock);
+  r = vmfault_mapped(p, pagetable, va, access);
+  release(&p->group->group_lock);
+  return r;
+}
+
+// vmfault() for a page that has a PTE.
+// caller holds p->group->group_lock if pagetable is p's
+// and p may have other threads.
+static int
+vmfault_mapped(struct proc *p, pagetable_t pagetable, uint64 va, int access)
+{
+  struct vma *v;
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  pte = walk_page_table(pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0)
+    return -1;  // unmapped by another thread meanwhile
+  if((*pte & PTE_U) && (*pte & access)){
+    // nothing to do but set A and D, for hardware that
+    // faults instead of setting them itself. the thread
+    // that mapped the page marked our TLB stale, so the
+    // retry sees the PTE.
+    pte_t old = *pte;
+    *pte |= PTE_A | (access == PTE_W ? PTE_D : 0);
+    if(*pte != old)
+      uvmflush(pagetable);
+    return 0;
+  }
+  // first store to a read-only MAP_SHARED page
+  if(access == PTE_W && (*pte & (PTE_U|PTE_W|PTE_COW)) == PTE_U &&
+     p && pagetable == p->pagetable && (v = mmap_lookup(p, va)) != 0)
+    return mmap_mkwrite(p, v, pte);
+  if(access != PTE_W || (*pte & PTE_U) == 0 || (*pte & PTE_COW) == 0)
+    return -1;
+
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  if(kpage_refcount((void*)pa) == 1){
+    // everyone else already took their own copy
+    *pte = PA2PTE(pa) | flags;
+  } else {
+    if((mem = kalloc()) == 0)
+      return -1;
+    memmove(mem, (char*)pa, PGSIZE);
+    *pte = PA2PTE(mem) | flags;
+    kernel_free_page((void*)pa);
+  }
+  uvmflush(pagetable);
+  return 0;
+}
+
+// give the current process p its own copy of every page it
+// still shares copy-on-write, for clone() to call before p
+// gets a second thread. breaking the sharing later would
+// mean a store fault swapping out a page that other threads
+// may still be using through their TLBs, and a fault can't
+// wait for them the way munmap() does (see tlb_shootdown()).
+// returns 0 on success, -1 if out of memory.
+int
+uvmunshare(struct proc *p)
+{
+  struct proc *g = p->group;
+
+  if(uvmunshare_range(p, 0, g->sz) < 0)
+    return -1;
+  for(int i = 0; i < NVMA; i++){
+    struct vma *v = &g->vmas[i];
+    if(v->used && uvmunshare_range(p, v->start, v->start + v->len) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+static int
+uvmunshare_range(struct proc *p, uint64 start, uint64 end)
+{
+  pte_t *pte;
+
+  for(uint64 va = start; va < end; va += PGSIZE){
+    pte = walk_page_table(p->pagetable, va, 0);
+    if(pte && (*pte & PTE_V) && (*pte & PTE_COW))
+      if(vmfault_mapped(p, p->pagetable, va, PTE_W) != 0)
+        return -1;
+  }
+  return 0;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -437,6 +871,7 @@ uvmclear(pagetable_t pagetable, uint64 va)
   if(pte == 0)
     panic("uvmclear");
   *pte &= ~PTE_U;
+  uvmflush(pagetable);
 }
 
 // Copy from kernel to user.
@@ -453,6 +888,12 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
     if(va0 >= MAXVA)
       return -1;
     pte = walk_page_table(pagetable, va0, 0);
+    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_W) == 0){
+      // lazy, copy-on-write or not-yet-dirty shared page - fault it in first
+      if(vmfault(pagetable, va0, PTE_W) != 0)
+        return -1;
+      pte = walk_page_table(pagetable, va0, 0);
+    }
     if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
        (*pte & PTE_W) == 0)
       return -1;
@@ -480,8 +921,14 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
+    if(pa0 == 0){
+      // maybe a lazily allocated page that hasn't been touched yet
+      if(vmfault(pagetable, va0, PTE_R) != 0)
+        return -1;
+      // another thread may have unmapped it again already
+      if((pa0 = walkaddr(pagetable, va0)) == 0)
+        return -1;
+    }
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
@@ -507,8 +954,14 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
+    if(pa0 == 0){
+      // maybe a lazily allocated page that hasn't been touched yet
+      if(vmfault(pagetable, va0, PTE_R) != 0)
+        return -1;
+      // another thread may have unmapped it again already
+      if((pa0 = walkaddr(pagetable, va0)) == 0)
+        return -1;
+    }
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
@@ -0,0 +1,102 @@
+// buffer cache scaling benchmark.
+//
+// Each of nproc processes makes a small file of its own, then
+// opens it, reads it through and closes it rounds times. The files
+// all fit in the buffer cache, so after the first round every
+// bread() is a hit, and the work is looking blocks up:
+//
+//   $ bcachebench [nproc [rounds]]
+//
+// It times 1, 2, ... nproc processes, each doing the same rounds.
+// With one lock over the whole cache the time grows with the number
+// of processes even on as many cpus; with the hashed cache, readers
+// of different blocks don't contend and it should stay about flat.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+#include "user/user.h"
+
+#define MAXPROC 8
+#define NBLOCK 3
+
+static char buf[BSIZE];
+
+static void
+name(char *s, int i)
+{
+  strcpy(s, "bcbench0");
+  s[7] = '0' + i;
+}
+
+static void
+reader(int i, int rounds)
+{
+  char file[16];
+
+  name(file, i);
+  for(int r = 0; r < rounds; r++){
+    int fd = open(file, O_RDONLY);
+    if(fd < 0){
+      printf("bcachebench: open %s failed\n", file);
+      exit(1);
+    }
+    while(read(fd, buf, sizeof(buf)) > 0)
+      ;
+    close(fd);
+  }
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nproc = 3, rounds = 2000;
+  char file[16];
+
+  if(argc > 1)
+    nproc = atoi(argv[1]);
+  if(argc > 2)
+    rounds = atoi(argv[2]);
+  if(nproc < 1 || nproc > MAXPROC){
+    printf("bcachebench: 1 to %d processes\n", MAXPROC);
+    exit(1);
+  }
+
+  memset(buf, 'x', sizeof(buf));
+  for(int i = 0; i < nproc; i++){
+    name(file, i);
+    int fd = open(file, O_CREATE|O_WRONLY);
+    if(fd < 0){
+      printf("bcachebench: create %s failed\n", file);
+      exit(1);
+    }
+    for(int b = 0; b < NBLOCK; b++)
+      write(fd, buf, sizeof(buf));
+    close(fd);
+  }
+
+  printf("bcachebench: %d rounds of open+read+close per process\n", rounds);
+  for(int n = 1; n <= nproc; n++){
+    int t0 = uptime();
+    for(int i = 0; i < n; i++){
+      int pid = fork();
+      if(pid < 0){
+        printf("bcachebench: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0)
+        reader(i, rounds);
+    }
+    for(int i = 0; i < n; i++)
+      wait(0);
+    printf("  %d processes: %d ticks\n", n, uptime() - t0);
+  }
+
+  for(int i = 0; i < nproc; i++){
+    name(file, i);
+    unlink(file);
+  }
+  exit(0);
+}
@@ -0,0 +1,86 @@
+// context switch benchmark.
+//
+// Two processes pass a byte back and forth over a pair of pipes,
+// so every round is two switches between them. Before each hand-off
+// a process reads one word from each of npages pages of its own
+// memory, as a stand-in for a working set it needs in the TLB:
+//
+//   $ ctxbench [npages [rounds]]
+//
+// If every return to user space flushes the TLB, each process has
+// to walk its page table again for every page after every switch.
+// With per-process ASIDs its translations are still there when it
+// next runs, so the cost per round barely grows with npages.
+// Run it with CPUS=1 so both processes share a hart.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+static int
+touch(volatile char *a, int npages)
+{
+  int sum = 0;
+  for(int i = 0; i < npages; i++)
+    sum += a[i * 4096];
+  return sum;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int npages = 32, rounds = 2000;
+  int ping[2], pong[2];
+  char c = 0;
+
+  if(argc > 1)
+    npages = atoi(argv[1]);
+  if(argc > 2)
+    rounds = atoi(argv[2]);
+
+  char *a = sbrk(npages * 4096);
+  if(a == (char*)-1){
+    printf("ctxbench: sbrk failed\n");
+    exit(1);
+  }
+  for(int i = 0; i < npages; i++)
+    a[i * 4096] = i;
+
+  if(pipe(ping) < 0 || pipe(pong) < 0){
+    printf("ctxbench: pipe failed\n");
+    exit(1);
+  }
+
+  int pid = fork();
+  if(pid < 0){
+    printf("ctxbench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    // the child's pages are copy-on-write; take our own copies first
+    for(int i = 0; i < npages; i++)
+      a[i * 4096] = i;
+    for(int r = 0; r < rounds; r++){
+      if(read(ping[0], &c, 1) != 1)
+        exit(1);
+      touch(a, npages);
+      write(pong[1], &c, 1);
+    }
+    exit(0);
+  }
+
+  int t0 = uptime();
+  for(int r = 0; r < rounds; r++){
+    touch(a, npages);
+    write(ping[1], &c, 1);
+    if(read(pong[0], &c, 1) != 1){
+      printf("ctxbench: read failed\n");
+      exit(1);
+    }
+  }
+  int t1 = uptime();
+  wait(0);
+
+  printf("ctxbench: %d pages, %d rounds: %d ticks\n", npages, rounds, t1 - t0);
+  exit(0);
+}
@@ -0,0 +1,69 @@
+// fork latency benchmark.
+//
+// Grows the process to SIZE pages, then times N rounds of
+// fork+exit and N rounds of fork+exec of a trivial program
+// (forkbench itself with the "x" argument, which exits at once):
+//
+//   $ forkbench [npages [rounds]]
+//
+// Without copy-on-write every fork copies all npages pages, so
+// the time per fork grows with process size; with it, a fork
+// costs roughly one page-table copy no matter how big the
+// process is.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+int
+main(int argc, char *argv[])
+{
+  int npages = 512, rounds = 100;
+
+  if(argc > 1 && strcmp(argv[1], "x") == 0)
+    exit(0);
+  if(argc > 1)
+    npages = atoi(argv[1]);
+  if(argc > 2)
+    rounds = atoi(argv[2]);
+
+  char *a = sbrk(npages * 4096);
+  if(a == (char*)-1){
+    printf("forkbench: sbrk failed\n");
+    exit(1);
+  }
+  for(int i = 0; i < npages; i++)
+    a[i * 4096] = i;
+
+  int t0 = uptime();
+  for(int r = 0; r < rounds; r++){
+    int pid = fork();
+    if(pid < 0){
+      printf("forkbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0)
+      exit(0);
+    wait(0);
+  }
+  int t1 = uptime();
+  for(int r = 0; r < rounds; r++){
+    int pid = fork();
+    if(pid < 0){
+      printf("forkbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      char *args[] = { "forkbench", "x", 0 };
+      exec("forkbench", args);
+      printf("forkbench: exec failed\n");
+      exit(1);
+    }
+    wait(0);
+  }
+  int t2 = uptime();
+
+  printf("forkbench: %d pages, %d rounds\n", npages, rounds);
+  printf("  fork+exit %d ticks, fork+exec %d ticks\n", t1 - t0, t2 - t1);
+  exit(0);
+}
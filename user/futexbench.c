@@ -0,0 +1,129 @@
+// lock contention benchmark.
+//
+// nthreads threads made by clone() each take a lock rounds times
+// to bump a shared counter, first with a spin lock and then with
+// the ulib mutex, which sleeps in futex_wait() when it's taken;
+// then two threads hand a token back and forth rounds times with
+// a condition variable:
+//
+//   $ futexbench [nthreads [rounds]]
+//
+// With more threads than cpus, a spinning thread burns the rest
+// of its quantum whenever the holder has been preempted, while a
+// sleeping one gives the cpu straight back.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define MAXTHREADS 8
+
+static int rounds;
+static int spinlock;
+static struct mutex mutex;
+static struct cond cond;
+static int counter;
+static int turn;
+
+static void
+spin_worker(void *arg)
+{
+  for(int i = 0; i < rounds; i++){
+    while(__sync_lock_test_and_set(&spinlock, 1) != 0)
+      ;
+    counter++;
+    __sync_lock_release(&spinlock);
+  }
+  exit(0);
+}
+
+static void
+mutex_worker(void *arg)
+{
+  for(int i = 0; i < rounds; i++){
+    mutex_lock(&mutex);
+    counter++;
+    mutex_unlock(&mutex);
+  }
+  exit(0);
+}
+
+// wait for our turn, then pass it to the other thread
+static void
+pingpong_worker(void *arg)
+{
+  int me = (int)(uint64)arg;
+
+  for(int i = 0; i < rounds; i++){
+    mutex_lock(&mutex);
+    while(turn != me)
+      cond_wait(&cond, &mutex);
+    turn = !me;
+    cond_signal(&cond);
+    mutex_unlock(&mutex);
+  }
+  exit(0);
+}
+
+// run n threads of fn, and return how many ticks they took
+static int
+run(void (*fn)(void*), int n, char *stacks)
+{
+  int t0 = uptime();
+
+  for(int i = 0; i < n; i++){
+    if(clone(fn, (void*)(uint64)i, stacks + (i+1)*PGSIZE) < 0){
+      printf("futexbench: clone failed\n");
+      exit(1);
+    }
+  }
+  for(int i = 0; i < n; i++)
+    join(0);
+  return uptime() - t0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nthreads = 4, t;
+  char *stacks;
+
+  rounds = 20000;
+  if(argc > 1)
+    nthreads = atoi(argv[1]);
+  if(argc > 2)
+    rounds = atoi(argv[2]);
+  if(nthreads < 2 || nthreads > MAXTHREADS){
+    printf("futexbench: 2 to %d threads\n", MAXTHREADS);
+    exit(1);
+  }
+  if((stacks = sbrk(MAXTHREADS * PGSIZE)) == (char*)-1){
+    printf("futexbench: sbrk failed\n");
+    exit(1);
+  }
+  mutex_init(&mutex);
+  cond_init(&cond);
+
+  printf("futexbench: %d threads, %d rounds\n", nthreads, rounds);
+  counter = 0;
+  t = run(spin_worker, nthreads, stacks);
+  if(counter != nthreads * rounds){
+    printf("futexbench: spin lock counted to %d\n", counter);
+    exit(1);
+  }
+  printf("  spin lock: %d ticks\n", t);
+
+  counter = 0;
+  t = run(mutex_worker, nthreads, stacks);
+  if(counter != nthreads * rounds){
+    printf("futexbench: mutex counted to %d\n", counter);
+    exit(1);
+  }
+  printf("  mutex: %d ticks\n", t);
+
+  turn = 0;
+  t = run(pingpong_worker, 2, stacks);
+  printf("  condvar ping-pong: %d ticks\n", t);
+  exit(0);
+}
@@ -14,7 +14,7 @@ char *argv[] = { "sh", 0 };
 int
 main(void)
 {
-  int pid, wpid;
+  int pid, wpid, fd;
 
   if(open("console", O_RDWR) < 0){
     mknod("console", CONSOLE, 0);
@@ -23,6 +23,14 @@ main(void)
   dup(0);  // stdout
   dup(0);  // stderr
 
+  // the kernel event trace (see latency)
+  if((fd = open("/dev/trace", O_RDONLY)) < 0){
+    mkdir("/dev");
+    mknod("/dev/trace", TRACE, 0);
+  } else {
+    close(fd);
+  }
+
   for(;;){
     printf("init: starting sh\n");
     pid = fork();
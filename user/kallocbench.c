@@ -0,0 +1,87 @@
+// Page allocator contention benchmark.
+//
+// Runs NCHILD processes that each loop allocating and freeing
+// pages (via sbrk) and forking short-lived children, then reports
+// how often the global free list lock was taken and how often a
+// cpu had to spin for it.  Run it under different CPUS= settings:
+//
+//   $ kallocbench [nchild [rounds]]
+//
+// With per-cpu page caches the global lock is taken roughly once
+// per batch of pages, so the contended count should stay near zero
+// as CPUS rises instead of growing with it.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define PAGES 64   // pages grabbed and released per round
+
+void
+churn(int rounds)
+{
+  for(int r = 0; r < rounds; r++){
+    char *a = sbrk(PAGES * 4096);
+    if(a == (char*)-1){
+      printf("kallocbench: sbrk failed\n");
+      exit(1);
+    }
+    for(int i = 0; i < PAGES; i++)
+      a[i * 4096] = r;
+    sbrk(-(PAGES * 4096));
+
+    // fork+exit exercises page-table and trapframe allocation too.
+    int pid = fork();
+    if(pid < 0){
+      printf("kallocbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0)
+      exit(0);
+    wait(0);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nchild = 4, rounds = 200;
+  struct kmemstat before, after;
+
+  if(argc > 1)
+    nchild = atoi(argv[1]);
+  if(argc > 2)
+    rounds = atoi(argv[2]);
+
+  if(kmemstat(&before) < 0){
+    printf("kallocbench: kmemstat failed\n");
+    exit(1);
+  }
+  int t0 = uptime();
+
+  for(int i = 0; i < nchild; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("kallocbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      churn(rounds);
+      exit(0);
+    }
+  }
+  for(int i = 0; i < nchild; i++)
+    wait(0);
+
+  int t1 = uptime();
+  kmemstat(&after);
+
+  uint64 acq = after.global_acquires - before.global_acquires;
+  uint64 cont = after.global_contended - before.global_contended;
+  printf("kallocbench: %d procs x %d rounds in %d ticks\n", nchild, rounds, t1 - t0);
+  printf("  global lock acquires %ld, contended %ld (%ld per 1000)\n",
+         acq, cont, acq ? cont * 1000 / acq : 0);
+  printf("  pages stolen between cpus %ld, free pages %ld\n",
+         after.steals - before.steals, after.free_pages);
+  exit(0);
+}
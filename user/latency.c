@@ -0,0 +1,241 @@
+// kernel latency histograms from the event trace.
+//
+// Turns on kernel tracing (see kernel/trace.c), runs a command (or
+// just waits ticks ticks), turns it off, and prints histograms of
+// where the time went:
+//
+//   $ latency [-t ticks] [command [args]]
+//
+// - system calls: entry to return, including any time asleep
+// - scheduling: made RUNNABLE (woken or preempted) to running again
+// - run time: switched to until switched away
+// - disk: request submitted to request done
+//
+// The trace rings hold the last 1024 events of each cpu, so a long
+// or busy run reports some events lost and only sees the end.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+#include "kernel/fcntl.h"
+#include "kernel/memlayout.h"
+#include "kernel/trace.h"
+#include "user/user.h"
+
+#define MAXEVENTS (NCPU * 1024)
+#define NBUCKET 24            // histogram buckets: < 1us, < 2us, < 4us, ...
+#define NSLOT 64              // per-pid state, hashed by pid
+#define NDISK 32              // outstanding disk requests
+
+struct hist {
+  char *name;
+  int n;
+  uint64 sum, max;            // microseconds
+  int count[NBUCKET];
+};
+
+static struct hist syscalls = { "system calls" };
+static struct hist schedlat = { "scheduling latency" };
+static struct hist runtime = { "run time" };
+static struct hist disklat = { "disk requests" };
+
+struct pidstate {
+  int pid;
+  uint64 syscall, runnable, run;    // when each began, or 0
+};
+
+static struct pidstate slots[NSLOT];
+
+static struct {
+  uint64 blockno, time;             // time is 0 if the entry is free
+} disk[NDISK];
+
+static struct trace_event *events, *sorted;
+static int ntraps, nlost;
+
+static void
+hist_add(struct hist *h, uint64 cycles)
+{
+  uint64 us = cycles / (TIMEBASE_FREQ / 1000000);
+  int b = 0;
+
+  while(b < NBUCKET-1 && us >= (1UL << b))
+    b++;
+  h->count[b]++;
+  h->n++;
+  h->sum += us;
+  if(us > h->max)
+    h->max = us;
+}
+
+static void
+hist_print(struct hist *h)
+{
+  printf("%s: %d", h->name, h->n);
+  if(h->n == 0){
+    printf("\n");
+    return;
+  }
+  printf(", mean %d us, max %d us\n", (int)(h->sum / h->n), (int)h->max);
+  for(int b = 0; b < NBUCKET; b++)
+    if(h->count[b])
+      printf("  < %d us: %d\n", 1 << b, h->count[b]);
+}
+
+// state for pid, claimed from whoever had its slot before
+static struct pidstate *
+slot(int pid)
+{
+  int i = pid % NSLOT;
+
+  if(slots[i].pid != pid){
+    memset(&slots[i], 0, sizeof(slots[i]));
+    slots[i].pid = pid;
+  }
+  return &slots[i];
+}
+
+static void
+account(struct trace_event *e)
+{
+  struct pidstate *s;
+  int i;
+
+  switch(e->type){
+  case TRACE_SYSCALL:
+    s = slot(e->pid);
+    s->syscall = e->time;
+    break;
+  case TRACE_SYSRET:
+    s = slot(e->pid);
+    if(s->syscall)
+      hist_add(&syscalls, e->time - s->syscall);
+    s->syscall = 0;
+    break;
+  case TRACE_RUNNABLE:
+    s = slot(e->pid);
+    s->runnable = e->time;
+    break;
+  case TRACE_RUN:
+    s = slot(e->pid);
+    if(s->runnable)
+      hist_add(&schedlat, e->time - s->runnable);
+    s->runnable = 0;
+    s->run = e->time;
+    break;
+  case TRACE_STOP:
+    s = slot(e->pid);
+    if(s->run)
+      hist_add(&runtime, e->time - s->run);
+    s->run = 0;
+    break;
+  case TRACE_TRAP:
+    ntraps++;
+    break;
+  case TRACE_DISK_SUBMIT:
+    for(i = 0; i < NDISK; i++){
+      if(disk[i].time == 0){
+        disk[i].blockno = e->arg & ~TRACE_DISK_WRITE;
+        disk[i].time = e->time;
+        break;
+      }
+    }
+    break;
+  case TRACE_DISK_DONE:
+    for(i = 0; i < NDISK; i++){
+      if(disk[i].time && disk[i].blockno == e->arg){
+        hist_add(&disklat, e->time - disk[i].time);
+        disk[i].time = 0;
+        break;
+      }
+    }
+    break;
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fd, n, ticks = 10, first = 1;
+  int start[NCPU+1], next[NCPU];
+
+  if(argc > 2 && strcmp(argv[1], "-t") == 0){
+    ticks = atoi(argv[2]);
+    first = 3;
+  }
+  events = malloc(MAXEVENTS * sizeof(struct trace_event));
+  sorted = malloc(MAXEVENTS * sizeof(struct trace_event));
+  if(events == 0 || sorted == 0){
+    printf("latency: out of memory\n");
+    exit(1);
+  }
+  if((fd = open("/dev/trace", O_RDWR)) < 0){
+    printf("latency: cannot open /dev/trace\n");
+    exit(1);
+  }
+
+  write(fd, "1", 1);
+  if(first < argc){
+    int pid = fork();
+    if(pid < 0){
+      printf("latency: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      close(fd);
+      exec(argv[first], argv + first);
+      printf("latency: exec %s failed\n", argv[first]);
+      exit(1);
+    }
+    wait(0);
+  } else {
+    sleep(ticks);
+  }
+  write(fd, "0", 1);
+
+  n = 0;
+  for(;;){
+    int r = read(fd, events + n, (MAXEVENTS - n) * sizeof(struct trace_event));
+    if(r <= 0)
+      break;
+    n += r / sizeof(struct trace_event);
+  }
+  close(fd);
+
+  // group the events by cpu, keeping each cpu's in order
+  memset(start, 0, sizeof(start));
+  for(int i = 0; i < n; i++){
+    if(events[i].type == TRACE_LOST)
+      nlost += events[i].arg;
+    else
+      start[events[i].cpu + 1]++;
+  }
+  for(int c = 0; c < NCPU; c++){
+    start[c+1] += start[c];
+    next[c] = start[c];
+  }
+  for(int i = 0; i < n; i++)
+    if(events[i].type != TRACE_LOST)
+      sorted[next[events[i].cpu]++] = events[i];
+
+  // and merge the cpus into time order
+  for(int c = 0; c < NCPU; c++)
+    next[c] = start[c];
+  for(;;){
+    int best = -1;
+    for(int c = 0; c < NCPU; c++)
+      if(next[c] < start[c+1] &&
+         (best < 0 || sorted[next[c]].time < sorted[next[best]].time))
+        best = c;
+    if(best < 0)
+      break;
+    account(&sorted[next[best]++]);
+  }
+
+  printf("latency: %d events, %d lost, %d traps\n", n, nlost, ntraps);
+  hist_print(&syscalls);
+  hist_print(&schedlat);
+  hist_print(&runtime);
+  hist_print(&disklat);
+  exit(0);
+}
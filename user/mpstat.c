@@ -0,0 +1,97 @@
+// per-cpu scheduling statistics.
+//
+// With no arguments, prints each cpu's counters since boot: how many
+// times it switched to a process, how many of those had last run on
+// another cpu (migrations), and how many it stole from another cpu's
+// run queue:
+//
+//   $ mpstat [nprocs [ticks]]
+//
+// With nprocs, runs nprocs cpu-bound processes for ticks ticks twice,
+// first free to run anywhere and then each pinned to one cpu with
+// set_affinity(), and prints the migrations and steals each run
+// caused. Pinned processes never migrate.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+#include "user/user.h"
+
+#define MAXPROCS 16
+
+static int ncpu;
+
+static void
+totals(uint64 *migrations, uint64 *steals)
+{
+  struct cpustat st[NCPU];
+
+  cpustat(st, NCPU);
+  *migrations = *steals = 0;
+  for(int i = 0; i < ncpu; i++){
+    *migrations += st[i].migrations;
+    *steals += st[i].steals;
+  }
+}
+
+// run nprocs spinning children for ticks ticks, pinned or not,
+// and print what that did to the counters
+static void
+run(int nprocs, int ticks, int pin)
+{
+  int pids[MAXPROCS];
+  uint64 m0, s0, m1, s1;
+
+  totals(&m0, &s0);
+  for(int i = 0; i < nprocs; i++){
+    pids[i] = fork();
+    if(pids[i] < 0){
+      printf("mpstat: fork failed\n");
+      exit(1);
+    }
+    if(pids[i] == 0){
+      if(pin && set_affinity(1 << (i % ncpu)) < 0){
+        printf("mpstat: set_affinity failed\n");
+        exit(1);
+      }
+      for(;;)
+        ;
+    }
+  }
+  sleep(ticks);
+  for(int i = 0; i < nprocs; i++)
+    kill(pids[i]);
+  for(int i = 0; i < nprocs; i++)
+    wait(0);
+  totals(&m1, &s1);
+  printf("  %s: %d migrations, %d steals\n", pin ? "pinned" : "unpinned",
+         (int)(m1 - m0), (int)(s1 - s0));
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct cpustat st[NCPU];
+  int nprocs, ticks = 20;
+
+  ncpu = cpustat(st, NCPU);
+  if(argc < 2){
+    printf("cpu switches migrations steals\n");
+    for(int i = 0; i < ncpu; i++)
+      printf("%d %d %d %d\n", i, (int)st[i].nswitch,
+             (int)st[i].migrations, (int)st[i].steals);
+    exit(0);
+  }
+
+  nprocs = atoi(argv[1]);
+  if(argc > 2)
+    ticks = atoi(argv[2]);
+  if(nprocs < 1 || nprocs > MAXPROCS){
+    printf("mpstat: 1 to %d processes\n", MAXPROCS);
+    exit(1);
+  }
+  printf("mpstat: %d processes on %d cpus for %d ticks\n", nprocs, ncpu, ticks);
+  run(nprocs, ticks, 0);
+  run(nprocs, ticks, 1);
+  exit(0);
+}
@@ -0,0 +1,82 @@
+// wakeup cost benchmark.
+//
+// Starts nidle processes that sleep forever (each blocked reading
+// its own pipe), then times rounds of a one-byte pipe ping-pong
+// between two more processes. Every round is two wake_up()s:
+//
+//   $ pingpong [nidle [rounds]]
+//
+// If wake_up() scans the whole process table, the time per round
+// grows with nidle; with per-channel wait queues it only looks at
+// the processes actually sleeping on the channel being woken.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+int
+main(int argc, char *argv[])
+{
+  int nidle = 40, rounds = 5000;
+  int hold[2], ping[2], pong[2];
+  char c = 0;
+
+  if(argc > 1)
+    nidle = atoi(argv[1]);
+  if(argc > 2)
+    rounds = atoi(argv[2]);
+
+  // the idle processes read hold[0] until we close hold[1]
+  if(pipe(hold) < 0){
+    printf("pingpong: pipe failed\n");
+    exit(1);
+  }
+  int started = 0;
+  for(; started < nidle; started++){
+    int pid = fork();
+    if(pid < 0)
+      break;
+    if(pid == 0){
+      close(hold[1]);
+      read(hold[0], &c, 1);
+      exit(0);
+    }
+  }
+  close(hold[0]);
+
+  if(pipe(ping) < 0 || pipe(pong) < 0){
+    printf("pingpong: pipe failed\n");
+    exit(1);
+  }
+  int pid = fork();
+  if(pid < 0){
+    printf("pingpong: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(hold[1]);
+    for(int r = 0; r < rounds; r++){
+      if(read(ping[0], &c, 1) != 1)
+        exit(1);
+      write(pong[1], &c, 1);
+    }
+    exit(0);
+  }
+
+  int t0 = uptime();
+  for(int r = 0; r < rounds; r++){
+    write(ping[1], &c, 1);
+    if(read(pong[0], &c, 1) != 1){
+      printf("pingpong: read failed\n");
+      exit(1);
+    }
+  }
+  int t1 = uptime();
+
+  close(hold[1]);
+  for(int i = 0; i < started + 1; i++)
+    wait(0);
+
+  printf("pingpong: %d idle processes, %d rounds: %d ticks\n", started, rounds, t1 - t0);
+  exit(0);
+}
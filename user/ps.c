@@ -0,0 +1,115 @@
+// list processes and the resources they have used.
+//
+//   $ ps
+//   $ ps -t [ticks [rounds]]
+//
+// The first form prints every process (and thread) with the cpu time
+// it has used, the system calls it has made, the page faults it has
+// taken and the disk blocks read for it. The second works like top:
+// every ticks ticks (default 10), for rounds rounds (default 5), it
+// prints the share of a cpu each process used over the interval and
+// how many system calls it made, busiest first.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+#include "kernel/memlayout.h"
+#include "user/user.h"
+
+static struct procinfo before[NPROC], after[NPROC];
+
+// cpu time in milliseconds
+static int
+ms(uint64 cycles)
+{
+  return cycles / (TIMEBASE_FREQ / 1000);
+}
+
+static void
+list(void)
+{
+  int n = procinfo(after, NPROC);
+
+  printf("pid ppid state cpu(ms) syscalls faults reads name\n");
+  for(int i = 0; i < n; i++){
+    struct procinfo *p = &after[i];
+    printf("%d %d %s %d %d %d %d %s", p->pid, p->ppid, p->state, ms(p->ru.cputime),
+           (int)p->ru.nsyscall, (int)p->ru.nfault, (int)p->ru.nblockread, p->name);
+    if(p->tgid != p->pid)
+      printf(" (thread of %d)", p->tgid);
+    printf("\n");
+  }
+}
+
+// one line of top: the process and what it did since the last round
+struct usageline {
+  struct procinfo *p;
+  uint64 cpu;        // cycles used in the interval
+  uint64 syscalls;
+};
+
+static void
+top(int ticks, int rounds)
+{
+  struct usageline lines[NPROC];
+  int nbefore, nafter, t0, t1;
+
+  nbefore = procinfo(before, NPROC);
+  t0 = uptime();
+  for(int r = 0; r < rounds; r++){
+    sleep(ticks);
+    nafter = procinfo(after, NPROC);
+    t1 = uptime();
+
+    int n = 0;
+    for(int i = 0; i < nafter; i++){
+      lines[n].p = &after[i];
+      lines[n].cpu = after[i].ru.cputime;
+      lines[n].syscalls = after[i].ru.nsyscall;
+      // a pid seen last round: count only what's new
+      for(int j = 0; j < nbefore; j++){
+        if(before[j].pid == after[i].pid){
+          lines[n].cpu -= before[j].ru.cputime;
+          lines[n].syscalls -= before[j].ru.nsyscall;
+          break;
+        }
+      }
+      n++;
+    }
+    // busiest first
+    for(int i = 1; i < n; i++){
+      struct usageline l = lines[i];
+      int j = i;
+      for(; j > 0 && lines[j-1].cpu < l.cpu; j--)
+        lines[j] = lines[j-1];
+      lines[j] = l;
+    }
+
+    uint64 interval = (uint64)(t1 - t0 > 0 ? t1 - t0 : 1) * TICK_CYCLES;
+    printf("\npid %%cpu syscalls state name\n");
+    for(int i = 0; i < n; i++){
+      struct procinfo *p = lines[i].p;
+      printf("%d %d %d %s %s\n", p->pid, (int)(lines[i].cpu * 100 / interval),
+             (int)lines[i].syscalls, p->state, p->name);
+    }
+
+    memmove(before, after, sizeof(after));
+    nbefore = nafter;
+    t0 = t1;
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  if(argc > 1 && strcmp(argv[1], "-t") == 0){
+    int ticks = argc > 2 ? atoi(argv[2]) : 10;
+    int rounds = argc > 3 ? atoi(argv[3]) : 5;
+    if(ticks < 1)
+      ticks = 1;
+    top(ticks, rounds);
+  } else {
+    list();
+  }
+  exit(0);
+}
@@ -0,0 +1,157 @@
+// buffer cache scan resistance benchmark.
+//
+// A metadata-heavy loop, like ls of the root directory: read the
+// directory and open, fstat and close everything in it, rounds
+// times. Its blocks (the directory, inode blocks) are few and hot.
+// Meanwhile a child reads through scan files of nblocks blocks in
+// all, each block once:
+//
+//   $ scanbench [nblocks [rounds]]
+//
+// It prints the disk reads the metadata loop needed alone, during
+// the scan and after it. With plain LRU the scan flushes the hot
+// blocks and the loop goes back to the disk for them; with 2Q the
+// scan only displaces its own blocks. The scan has to be bigger
+// than the cache for this to show (nbuf below; the cache grows to
+// NBUF_MAX), so it makes as much as the disk has room for.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+#include "user/user.h"
+
+#define FILEBLOCKS 256        // blocks per scan file, under MAXFILE
+#define MAXFILES 16
+
+static char buf[BSIZE];
+static int nfiles;
+
+static void
+name(char *s, int i)
+{
+  strcpy(s, "scan00");
+  s[4] = '0' + i / 10;
+  s[5] = '0' + i % 10;
+}
+
+// make files holding up to nblocks blocks; returns how many they got
+static int
+makefiles(int nblocks)
+{
+  char file[16];
+  int n = 0;
+
+  memset(buf, 's', sizeof(buf));
+  for(nfiles = 0; nfiles < MAXFILES && n < nblocks; nfiles++){
+    name(file, nfiles);
+    int fd = open(file, O_CREATE|O_WRONLY);
+    if(fd < 0)
+      break;
+    for(int b = 0; b < FILEBLOCKS && n < nblocks; b++, n++){
+      if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+        close(fd);
+        nfiles++;
+        return n;       // the disk is full
+      }
+    }
+    close(fd);
+  }
+  return n;
+}
+
+static void
+scan(void)
+{
+  char file[16];
+
+  for(int i = 0; i < nfiles; i++){
+    name(file, i);
+    int fd = open(file, O_RDONLY);
+    if(fd < 0){
+      printf("scanbench: open %s failed\n", file);
+      exit(1);
+    }
+    while(read(fd, buf, sizeof(buf)) > 0)
+      ;
+    close(fd);
+  }
+}
+
+// ls / rounds times without printing; returns the disk blocks it read
+static int
+lsloop(int rounds)
+{
+  struct rusage ru0, ru1;
+  struct dirent de;
+  struct stat st;
+  char path[DIRSIZ+2];
+
+  getrusage(RUSAGE_SELF, &ru0);
+  for(int r = 0; r < rounds; r++){
+    int dfd = open("/", O_RDONLY);
+    if(dfd < 0){
+      printf("scanbench: cannot open /\n");
+      exit(1);
+    }
+    while(read(dfd, &de, sizeof(de)) == sizeof(de)){
+      if(de.inum == 0)
+        continue;
+      path[0] = '/';
+      memmove(path+1, de.name, DIRSIZ);
+      path[DIRSIZ+1] = 0;
+      int fd = open(path, O_RDONLY);
+      if(fd >= 0){
+        fstat(fd, &st);
+        close(fd);
+      }
+    }
+    close(dfd);
+  }
+  getrusage(RUSAGE_SELF, &ru1);
+  return ru1.nblockread - ru0.nblockread;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nblocks = MAXFILES * FILEBLOCKS, rounds = 20, pid, reads;
+  struct bcachestat st0, st1;
+  char file[16];
+
+  if(argc > 1)
+    nblocks = atoi(argv[1]);
+  if(argc > 2)
+    rounds = atoi(argv[2]);
+
+  nblocks = makefiles(nblocks);
+  lsloop(1);
+  bcachestat(&st0);
+  printf("scanbench: %d scan blocks, cache of %d buffers (%d hot)\n",
+         nblocks, (int)st0.nbuf, (int)st0.nhot);
+  printf("  ls alone: %d disk reads\n", lsloop(rounds));
+
+  bcachestat(&st0);
+  if((pid = fork()) < 0){
+    printf("scanbench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    scan();
+    exit(0);
+  }
+  reads = lsloop(rounds);
+  wait(0);
+  bcachestat(&st1);
+  printf("  ls during scan: %d disk reads\n", reads);
+  printf("  ls after scan: %d disk reads\n", lsloop(rounds));
+  printf("  cache during scan: %d hits, %d misses, %d ghost hits\n",
+         (int)(st1.hits - st0.hits), (int)(st1.misses - st0.misses),
+         (int)(st1.ghosthits - st0.ghosthits));
+
+  for(int i = 0; i < nfiles; i++){
+    name(file, i);
+    unlink(file);
+  }
+  exit(0);
+}
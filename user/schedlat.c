@@ -0,0 +1,71 @@
+// interactive response latency under cpu-bound load.
+//
+// Starts nhogs processes that spin forever, then does n rounds of
+// sleep(1), as an interactive program waiting for input would, and
+// reports how many ticks the n rounds took. With nothing else running
+// that's about n ticks; every extra tick is time the woken process
+// spent waiting for a cpu:
+//
+//   $ schedlat [nhogs [n]]
+//
+// Under round-robin each wakeup waits its turn behind the hogs, so
+// the total grows with nhogs. With SCHED_MLFQ the hogs sink to the
+// lowest level while the sleeper stays on top and gets the cpu at
+// the next tick. Run it with CPUS=1 to make the difference plain.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define MAXHOGS 16
+
+int
+main(int argc, char *argv[])
+{
+  int nhogs = 4, n = 50;
+  int pids[MAXHOGS];
+
+  if(argc > 1)
+    nhogs = atoi(argv[1]);
+  if(argc > 2)
+    n = atoi(argv[2]);
+  if(nhogs > MAXHOGS)
+    nhogs = MAXHOGS;
+
+  for(int i = 0; i < nhogs; i++){
+    pids[i] = fork();
+    if(pids[i] < 0){
+      printf("schedlat: fork failed\n");
+      nhogs = i;
+      break;
+    }
+    if(pids[i] == 0){
+      volatile uint x = 0;
+      for(;;)
+        x++;
+    }
+  }
+
+  // give the hogs time to use up their slices
+  sleep(5);
+
+  int t0 = uptime();
+  int worst = 0;
+  for(int i = 0; i < n; i++){
+    int s = uptime();
+    sleep(1);
+    int d = uptime() - s;
+    if(d > worst)
+      worst = d;
+  }
+  int t1 = uptime();
+
+  for(int i = 0; i < nhogs; i++){
+    kill(pids[i]);
+    wait(0);
+  }
+
+  printf("schedlat: %d hogs, %d sleep(1)s took %d ticks, worst %d\n",
+         nhogs, n, t1 - t0, worst);
+  exit(0);
+}
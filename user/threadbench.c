@@ -0,0 +1,91 @@
+// thread scaling benchmark.
+//
+// Splits a fixed amount of work, summing a shared array over and
+// over, between 1, 2, ... nthreads threads made by clone(), and
+// times each split:
+//
+//   $ threadbench [nthreads [npages [rounds]]]
+//
+// The threads share the array and their results, so there is no
+// copying and no pipe traffic; on a machine with as many cpus as
+// threads the time should drop roughly in proportion to the
+// number of threads.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define MAXTHREADS 8
+
+static int *array;
+static int nints, rounds, nthreads;
+static uint64 sums[MAXTHREADS];
+
+static void
+worker(void *arg)
+{
+  int id = (int)(uint64)arg;
+  int lo = nints / nthreads * id;
+  int hi = id == nthreads - 1 ? nints : lo + nints / nthreads;
+  uint64 sum = 0;
+
+  for(int r = 0; r < rounds; r++)
+    for(int i = lo; i < hi; i++)
+      sum += array[i];
+  sums[id] = sum;
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int maxthreads = 3, npages = 64;
+  char *stacks;
+
+  rounds = 200;
+  if(argc > 1)
+    maxthreads = atoi(argv[1]);
+  if(argc > 2)
+    npages = atoi(argv[2]);
+  if(argc > 3)
+    rounds = atoi(argv[3]);
+  if(maxthreads < 1 || maxthreads > MAXTHREADS){
+    printf("threadbench: 1 to %d threads\n", MAXTHREADS);
+    exit(1);
+  }
+
+  nints = npages * PGSIZE / sizeof(int);
+  array = (int*)sbrk(npages * PGSIZE);
+  stacks = sbrk(MAXTHREADS * PGSIZE);
+  if((char*)array == (char*)-1 || stacks == (char*)-1){
+    printf("threadbench: sbrk failed\n");
+    exit(1);
+  }
+  for(int i = 0; i < nints; i++)
+    array[i] = i;
+
+  printf("threadbench: %d pages, %d rounds\n", npages, rounds);
+  for(nthreads = 1; nthreads <= maxthreads; nthreads++){
+    int t0 = uptime();
+    for(int i = 0; i < nthreads; i++){
+      if(clone(worker, (void*)(uint64)i, stacks + (i+1)*PGSIZE) < 0){
+        printf("threadbench: clone failed\n");
+        exit(1);
+      }
+    }
+    for(int i = 0; i < nthreads; i++)
+      join(0);
+    int t1 = uptime();
+
+    uint64 total = 0;
+    for(int i = 0; i < nthreads; i++)
+      total += sums[i];
+    if(total != (uint64)rounds * nints * (nints - 1) / 2){
+      printf("threadbench: wrong sum with %d threads\n", nthreads);
+      exit(1);
+    }
+    printf("  %d threads: %d ticks\n", nthreads, t1 - t0);
+  }
+  exit(0);
+}
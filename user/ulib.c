@@ -1,6 +1,7 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "kernel/fcntl.h"
+#include "kernel/param.h"
 #include "user/user.h"
 
 //
@@ -145,3 +146,73 @@ memcpy(void *dst, const void *src, uint n)
 {
   return memmove(dst, src, n);
 }
+
+// mutexes, sleeping in the kernel when contended (see futex_wait()).
+// state is 0 when unlocked, 1 when locked, and 2 when locked and
+// someone may be waiting, so an unlock only makes a system call
+// if it might have to wake someone. from Drepper, "Futexes Are Tricky".
+void
+mutex_init(struct mutex *m)
+{
+  m->state = 0;
+}
+
+void
+mutex_lock(struct mutex *m)
+{
+  int c;
+
+  if((c = __sync_val_compare_and_swap(&m->state, 0, 1)) == 0)
+    return;
+  // mark it contended before sleeping, so the holder wakes us
+  if(c != 2)
+    c = __atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE);
+  while(c != 0){
+    futex_wait(&m->state, 2);
+    c = __atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE);
+  }
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+  if(__sync_fetch_and_sub(&m->state, 1) != 1){
+    __atomic_store_n(&m->state, 0, __ATOMIC_RELEASE);
+    futex_wake(&m->state, 1);
+  }
+}
+
+// condition variables: seq changes on every signal, so a waiter
+// that reads it before unlocking the mutex can't miss a signal
+// sent after the unlock; futex_wait() just returns at once.
+// as with any condition variable, the caller rechecks its
+// condition after cond_wait() returns.
+void
+cond_init(struct cond *c)
+{
+  c->seq = 0;
+}
+
+void
+cond_wait(struct cond *c, struct mutex *m)
+{
+  int seq = __atomic_load_n(&c->seq, __ATOMIC_RELAXED);
+
+  mutex_unlock(m);
+  futex_wait(&c->seq, seq);
+  mutex_lock(m);
+}
+
+void
+cond_signal(struct cond *c)
+{
+  __sync_fetch_and_add(&c->seq, 1);
+  futex_wake(&c->seq, 1);
+}
+
+void
+cond_broadcast(struct cond *c)
+{
+  __sync_fetch_and_add(&c->seq, 1);
+  futex_wake(&c->seq, NPROC);
+}
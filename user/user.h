@@ -1,4 +1,18 @@
 struct stat;
+struct kmemstat;
+struct cpustat;
+struct rusage;
+struct procinfo;
+struct bcachestat;
+
+// ulib.c locks, on top of futex_wait() and futex_wake()
+struct mutex {
+  int state;
+};
+
+struct cond {
+  int seq;
+};
 
 // system calls
 int fork(void);
@@ -22,6 +36,21 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int kmemstat(struct kmemstat*);
+void* mmap(void*, uint64, int, int, int, uint64);
+int munmap(void*, uint64);
+int setquantum(int, int);
+int nanosleep(uint64);
+int clone(void (*)(void*), void*, void*);
+int join(int);
+int futex_wait(int*, int);
+int futex_wake(int*, int);
+int set_affinity(int);
+int cpustat(struct cpustat*, int);
+int getrusage(int, struct rusage*);
+int waitrusage(int*, struct rusage*);
+int procinfo(struct procinfo*, int);
+int bcachestat(struct bcachestat*);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -37,6 +66,13 @@ void* memset(void*, int, uint);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
+void mutex_init(struct mutex*);
+void mutex_lock(struct mutex*);
+void mutex_unlock(struct mutex*);
+void cond_init(struct cond*);
+void cond_wait(struct cond*, struct mutex*);
+void cond_signal(struct cond*);
+void cond_broadcast(struct cond*);
 
 // umalloc.c
 void* malloc(uint);
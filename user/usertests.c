@@ -7,6 +7,7 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/trace.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -788,6 +789,80 @@ pipe1(char *s)
   }
 }
 
+// open pipes until the system-wide file table is full, in
+// several processes at once, check each one carries data, then
+// close them all and check that just as many can be opened again.
+// pipes and files come from slab caches, so this exercises slab
+// growth, the NFILE limit, and freeing slabs back to kalloc.
+int
+manypipes_round(char *s)
+{
+  enum { NCHILD=10, NPIPE=7 };
+  int report[2], hold[2], total = 0;
+
+  if(pipe(report) != 0 || pipe(hold) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  for(int c = 0; c < NCHILD; c++){
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      int fds[NPIPE][2], n;
+      char ch = 0;
+      close(report[0]);
+      close(hold[1]);
+      for(n = 0; n < NPIPE; n++)
+        if(pipe(fds[n]) != 0)
+          break;
+      for(int i = 0; i < n; i++){
+        char x = 'a' + i;
+        if(write(fds[i][1], &x, 1) != 1 || read(fds[i][0], &ch, 1) != 1 || ch != x){
+          printf("%s: pipe %d lost data\n", s, i);
+          exit(1);
+        }
+      }
+      // hold the pipes open until everyone has filled the table
+      write(report[1], &n, sizeof(n));
+      read(hold[0], &ch, 1);
+      exit(0);
+    }
+  }
+  close(report[1]);
+  for(int c = 0; c < NCHILD; c++){
+    int n;
+    if(read(report[0], &n, sizeof(n)) != sizeof(n)){
+      printf("%s: short report\n", s);
+      exit(1);
+    }
+    total += n;
+  }
+  close(report[0]);
+  close(hold[0]);
+  close(hold[1]);
+  for(int c = 0; c < NCHILD; c++){
+    int xstatus;
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
+  }
+  return total;
+}
+
+void
+manypipes(char *s)
+{
+  int n1 = manypipes_round(s);
+  int n2 = manypipes_round(s);
+  if(n1 < 20 || n2 != n1){
+    printf("%s: opened %d pipes, then %d\n", s, n1, n2);
+    exit(1);
+  }
+}
+
 
 // test if child is killed (status = -1)
 void
@@ -1996,6 +2071,961 @@ forktest(char *s)
   }
 }
 
+// fork a process holding most of free memory. with copy-on-write
+// fork the child shares the pages, so this only fits if they are
+// not copied up front; then check that stores by parent and child
+// (including through copyout, via read()) stay private to each.
+void
+cowfork(char *s)
+{
+  struct kmemstat st;
+  int fds[2], xstatus;
+
+  if(kmemstat(&st) < 0){
+    printf("%s: kmemstat failed\n", s);
+    exit(1);
+  }
+  uint64 sz = (st.free_pages * 2 / 3) * 4096;
+  char *a = sbrk(sz);
+  if(a == (char*)-1){
+    printf("%s: sbrk(%ld) failed\n", s, sz);
+    exit(1);
+  }
+  for(uint64 i = 0; i < sz; i += 4096)
+    a[i] = 'p';
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  int pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed, pages copied?\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(uint64 i = 0; i < sz; i += 64*4096){
+      if(a[i] != 'p'){
+        printf("%s: child sees wrong data\n", s);
+        exit(1);
+      }
+      a[i] = 'c';
+    }
+    // copyout into a shared page
+    if(read(fds[0], a + 4096, 1) != 1 || a[4096] != 'x'){
+      printf("%s: read into cow page failed\n", s);
+      exit(1);
+    }
+    exit(0);
+  }
+  a[4096] = 'q';
+  write(fds[1], "x", 1);
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  for(uint64 i = 0; i < sz; i += 64*4096){
+    if(a[i] != 'p'){
+      printf("%s: child's store leaked into parent\n", s);
+      exit(1);
+    }
+  }
+  if(a[4096] != 'q'){
+    printf("%s: child's read leaked into parent\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  sbrk(-sz);
+}
+
+// sbrk() only reserves address space; pages are allocated on first
+// touch, by user code or by the kernel (copyout via read()).
+void
+lazysbrk(char *s)
+{
+  enum { BIG=1024*1024*1024 };
+  struct kmemstat st0, st1;
+  int fd;
+
+  kmemstat(&st0);
+  char *a = sbrk(BIG);
+  if(a == (char*)-1){
+    printf("%s: sbrk(1GB) failed\n", s);
+    exit(1);
+  }
+  kmemstat(&st1);
+  if(st0.free_pages - st1.free_pages > 16){
+    printf("%s: sbrk allocated %ld pages up front\n", s, st0.free_pages - st1.free_pages);
+    exit(1);
+  }
+
+  // untouched pages read as zero, stores stick
+  for(uint64 i = 0; i < BIG; i += BIG/16){
+    if(a[i] != 0){
+      printf("%s: lazy page not zero\n", s);
+      exit(1);
+    }
+    a[i] = 'z';
+  }
+  if(a[BIG/16] != 'z'){
+    printf("%s: store lost\n", s);
+    exit(1);
+  }
+
+  // the kernel faults pages in for system calls too
+  if((fd = open("README", 0)) < 0){
+    printf("%s: open README failed\n", s);
+    exit(1);
+  }
+  if(read(fd, a + BIG - 4096 - 10, 20) != 20){
+    printf("%s: read into lazy pages failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // a short read into a big buffer only allocates what it fills
+  int fds[2];
+  if(pipe(fds) < 0 || write(fds[1], "lazy", 4) != 4){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  kmemstat(&st0);
+  if(read(fds[0], a + BIG/2 + PGSIZE, BIG/32) != 4){
+    printf("%s: short read from pipe failed\n", s);
+    exit(1);
+  }
+  kmemstat(&st1);
+  if(st0.free_pages - st1.free_pages > 16){
+    printf("%s: 4-byte read allocated %ld pages\n", s, st0.free_pages - st1.free_pages);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  sbrk(-BIG);
+}
+
+// file-backed and anonymous mmap(): private and shared
+// mappings, partial munmap, write-back, and fork.
+void
+mmaptest(char *s)
+{
+  enum { FSZ = 2*PGSIZE + PGSIZE/2 };
+  int fd, xstatus;
+  char *p;
+
+  unlink("mmapfile");
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create mmapfile failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < FSZ; i++){
+    char c = 'a' + i % 23;
+    if(write(fd, &c, 1) != 1){
+      printf("%s: write mmapfile failed\n", s);
+      exit(1);
+    }
+  }
+
+  // private, read-only: file contents, zeros past end of file
+  p = mmap(0, 3*PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < 3*PGSIZE; i++){
+    if(p[i] != (i < FSZ ? 'a' + i % 23 : 0)){
+      printf("%s: mmap private byte %d wrong\n", s, i);
+      exit(1);
+    }
+  }
+  if(munmap(p, 3*PGSIZE) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  // shared, writable: stores reach the file; the mapping
+  // outlives the fd; unmap a page from the front, then the rest
+  p = mmap(0, 3*PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  p[0] = 'A';
+  p[PGSIZE + 904] = 'B';
+  if(munmap(p, PGSIZE) != 0 || munmap(p + PGSIZE, 2*PGSIZE) != 0){
+    printf("%s: partial munmap failed\n", s);
+    exit(1);
+  }
+  fd = open("mmapfile", O_RDONLY);
+  if(fd < 0 || read(fd, buf, PGSIZE + 905) != PGSIZE + 905){
+    printf("%s: reread mmapfile failed\n", s);
+    exit(1);
+  }
+  if(buf[0] != 'A' || buf[PGSIZE + 904] != 'B' || buf[1] != 'b'){
+    printf("%s: shared stores not written back\n", s);
+    exit(1);
+  }
+  struct stat st;
+  if(fstat(fd, &st) < 0 || st.size != FSZ){
+    printf("%s: write-back changed file size\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // pages are read from the file whatever prot says, so a
+  // write-only fd can't be mapped at all
+  fd = open("mmapfile", O_WRONLY);
+  if(fd < 0){
+    printf("%s: open mmapfile write-only failed\n", s);
+    exit(1);
+  }
+  if(mmap(0, PGSIZE, PROT_WRITE, MAP_PRIVATE, fd, 0) != (char*)-1 ||
+     mmap(0, PGSIZE, PROT_EXEC, MAP_PRIVATE, fd, 0) != (char*)-1){
+    printf("%s: mapped a write-only fd\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("mmapfile");
+
+  // a write-only mapping can still be stored to and read back
+  p = mmap(0, PGSIZE, PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap write-only failed\n", s);
+    exit(1);
+  }
+  p[10] = 'w';
+  if(p[10] != 'w'){
+    printf("%s: write-only mapping lost a store\n", s);
+    exit(1);
+  }
+  munmap(p, PGSIZE);
+
+  // a length that would round up past 2^64 to 0
+  if(mmap(0, -1UL, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0) != (char*)-1 ||
+     munmap((char*)PGSIZE, -1UL) != -1){
+    printf("%s: huge length accepted\n", s);
+    exit(1);
+  }
+
+  // anonymous: private pages are copy-on-write across fork,
+  // shared ones stay shared
+  char *priv = mmap(0, 2*PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  char *shr = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if(priv == (char*)-1 || shr == (char*)-1){
+    printf("%s: mmap anonymous failed\n", s);
+    exit(1);
+  }
+  if(priv[PGSIZE] != 0){
+    printf("%s: anonymous page not zero\n", s);
+    exit(1);
+  }
+  priv[0] = 'p';
+  shr[0] = 's';
+  int pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(priv[0] != 'p' || shr[0] != 's')
+      exit(1);
+    priv[0] = 'c';
+    shr[0] = 'c';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || priv[0] != 'p' || shr[0] != 'c'){
+    printf("%s: anonymous mapping wrong after fork\n", s);
+    exit(1);
+  }
+  munmap(priv, 2*PGSIZE);
+  munmap(shr, PGSIZE);
+
+  // touching an unmapped region kills the process
+  pid = fork();
+  if(pid == 0){
+    priv[0] = 1;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: store to unmapped region succeeded\n", s);
+    exit(1);
+  }
+}
+
+// with a quantum much longer than a tick, sleep() must still
+// wake on time and uptime() must still advance, even while a
+// cpu-bound process keeps a cpu from taking timer interrupts.
+void
+quantum(char *s)
+{
+  int pid, t0, t1;
+
+  if(setquantum(NCPU, 0) != -1 || setquantum(-1, 10) != -1){
+    printf("%s: setquantum accepted bad arguments\n", s);
+    exit(1);
+  }
+  if(setquantum(-1, 3000000) != 0){
+    printf("%s: setquantum failed\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    setquantum(-1, 0);
+    exit(1);
+  }
+  if(pid == 0){
+    // spin until uptime() says 5 ticks have gone by
+    t0 = uptime();
+    while(uptime() - t0 < 5)
+      ;
+    exit(0);
+  }
+
+  t0 = uptime();
+  sleep(3);
+  t1 = uptime();
+  wait(0);
+  setquantum(-1, 0);
+
+  if(t1 - t0 < 3 || t1 - t0 > 10){
+    printf("%s: sleep(3) took %d ticks\n", s, t1 - t0);
+    exit(1);
+  }
+}
+
+// nanosleep() wakes on time rather than at the next tick,
+// and a killed process doesn't sleep out its time.
+void
+nanosleeptest(char *s)
+{
+  int t0, t1, pid, xstatus;
+
+  // 20 sleeps of 1ms each, well under the 100ms of a tick
+  t0 = uptime();
+  for(int i = 0; i < 20; i++)
+    nanosleep(1000000);
+  t1 = uptime();
+  if(t1 - t0 > 5){
+    printf("%s: 20 1ms nanosleeps took %d ticks\n", s, t1 - t0);
+    exit(1);
+  }
+
+  t0 = uptime();
+  nanosleep(250000000);
+  t1 = uptime();
+  if(t1 - t0 < 2){
+    printf("%s: 250ms nanosleep took %d ticks\n", s, t1 - t0);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    nanosleep(100L * 1000000000);
+    exit(0);
+  }
+  t0 = uptime();
+  sleep(1);
+  kill(pid);
+  wait(&xstatus);
+  t1 = uptime();
+  if(t1 - t0 > 10){
+    printf("%s: killed nanosleep didn't return\n", s);
+    exit(1);
+  }
+}
+
+// threads made by clone() share memory and file descriptors,
+// and join() collects them.
+static int clone_count;
+static int clone_fd = -1;
+
+static void
+clone_worker(void *arg)
+{
+  for(int i = 0; i < 1000; i++)
+    __sync_fetch_and_add(&clone_count, 1);
+  if((uint64)arg == 0)
+    clone_fd = open("clonefile", O_CREATE|O_RDWR);
+  exit(0);
+}
+
+static void
+clone_spin(void *arg)
+{
+  for(;;)
+    ;
+}
+
+void
+clonetest(char *s)
+{
+  enum { N = 4 };
+  int tids[N], pid, xstatus, t0;
+  char *stacks = sbrk(N * PGSIZE);
+
+  if(stacks == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < N; i++){
+    tids[i] = clone(clone_worker, (void*)(uint64)i, stacks + (i+1)*PGSIZE);
+    if(tids[i] < 0){
+      printf("%s: clone failed\n", s);
+      exit(1);
+    }
+  }
+  for(int i = 0; i < N; i++){
+    if(join(tids[i]) != tids[i]){
+      printf("%s: join failed\n", s);
+      exit(1);
+    }
+  }
+  if(join(0) != -1){
+    printf("%s: join with no threads succeeded\n", s);
+    exit(1);
+  }
+  if(clone_count != N * 1000){
+    printf("%s: threads counted to %d, not %d\n", s, clone_count, N * 1000);
+    exit(1);
+  }
+  // a descriptor a thread opened is the process's
+  if(clone_fd < 0 || write(clone_fd, "x", 1) != 1){
+    printf("%s: thread's descriptor not shared\n", s);
+    exit(1);
+  }
+  close(clone_fd);
+  unlink("clonefile");
+
+  // with threads running: exec() fails, sbrk() can shrink memory
+  // out from under them, and the first thread's exit() takes the
+  // others with it
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(int i = 0; i < 2; i++)
+      if(clone(clone_spin, 0, stacks + (i+1)*PGSIZE) < 0)
+        exit(1);
+    char *argv[] = { "echo", "exec", "succeeded", 0 };
+    if(exec("echo", argv) != -1)
+      exit(2);
+    char *a = sbrk(PGSIZE);
+    a[0] = 1;
+    sbrk(-PGSIZE);
+    exit(0);
+  }
+  t0 = uptime();
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: threaded child failed with %d\n", s, xstatus);
+    exit(1);
+  }
+  if(uptime() - t0 > 20){
+    printf("%s: threaded child took %d ticks to exit\n", s, uptime() - t0);
+    exit(1);
+  }
+}
+
+// futex_wait() sleeps only while the word holds the value, and
+// futex_wake() wakes it; the ulib mutex built on them excludes.
+static int futex_word;
+static int futex_woken;
+static struct mutex futex_mutex;
+static int futex_counter;
+
+static void
+futex_waiter(void *arg)
+{
+  while(__atomic_load_n(&futex_word, __ATOMIC_ACQUIRE) == 0)
+    futex_wait(&futex_word, 0);
+  futex_woken = 1;
+  exit(0);
+}
+
+static void
+futex_incr(void *arg)
+{
+  for(int i = 0; i < 2000; i++){
+    mutex_lock(&futex_mutex);
+    int c = futex_counter;
+    if(i % 100 == 0)
+      nanosleep(1000000);  // give up the cpu inside, so the others contend
+    futex_counter = c + 1;
+    mutex_unlock(&futex_mutex);
+  }
+  exit(0);
+}
+
+void
+futextest(char *s)
+{
+  enum { N = 4 };
+  char *stacks = sbrk(N * PGSIZE);
+
+  if(stacks == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+
+  futex_word = 1;
+  if(futex_wait(&futex_word, 0) != -1){
+    printf("%s: futex_wait slept with the wrong value\n", s);
+    exit(1);
+  }
+  if(futex_wake(&futex_word, 1) != 0){
+    printf("%s: futex_wake woke someone with no waiters\n", s);
+    exit(1);
+  }
+
+  futex_word = 0;
+  if(clone(futex_waiter, 0, stacks + PGSIZE) < 0){
+    printf("%s: clone failed\n", s);
+    exit(1);
+  }
+  sleep(2);
+  if(futex_woken){
+    printf("%s: waiter didn't wait\n", s);
+    exit(1);
+  }
+  __atomic_store_n(&futex_word, 1, __ATOMIC_RELEASE);
+  futex_wake(&futex_word, 1);
+  join(0);
+  if(!futex_woken){
+    printf("%s: waiter wasn't woken\n", s);
+    exit(1);
+  }
+
+  mutex_init(&futex_mutex);
+  for(int i = 0; i < N; i++){
+    if(clone(futex_incr, 0, stacks + (i+1)*PGSIZE) < 0){
+      printf("%s: clone failed\n", s);
+      exit(1);
+    }
+  }
+  for(int i = 0; i < N; i++)
+    join(0);
+  if(futex_counter != N * 2000){
+    printf("%s: mutex counted to %d, not %d\n", s, futex_counter, N * 2000);
+    exit(1);
+  }
+}
+
+// the calling process's procinfo() entry, or 0
+static struct procinfo *
+myprocinfo(void)
+{
+  static struct procinfo pi[NPROC];
+  int n = procinfo(pi, NPROC);
+
+  for(int i = 0; i < n; i++)
+    if(pi[i].pid == getpid())
+      return &pi[i];
+  return 0;
+}
+
+// set_affinity() limits a process to some cpus, fork() passes the
+// mask on, and a process pinned to one cpu never migrates.
+void
+affinitytest(char *s)
+{
+  struct cpustat st0[NCPU];
+  int ncpu, all, pid, xstatus;
+
+  ncpu = cpustat(st0, NCPU);
+  if(ncpu < 1 || ncpu > NCPU){
+    printf("%s: cpustat says %d cpus\n", s, ncpu);
+    exit(1);
+  }
+  all = set_affinity(0);
+  if(all != (1 << ncpu) - 1){
+    printf("%s: default affinity %d\n", s, all);
+    exit(1);
+  }
+  if(set_affinity(1 << NCPU) != -1){
+    printf("%s: affinity with no cpu succeeded\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(set_affinity(1) != all)
+      exit(1);
+    int pid2 = fork();
+    if(pid2 < 0)
+      exit(1);
+    if(pid2 == 0)
+      exit(set_affinity(0) == 1 ? 0 : 2);
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
+    // each sleep switches away, and back to us, always on cpu 0
+    struct procinfo *pi;
+    uint64 nswitch;
+    if((pi = myprocinfo()) == 0)
+      exit(3);
+    nswitch = pi->ru.nswitch;
+    for(int i = 0; i < 50; i++){
+      nanosleep(1000000);
+      if((pi = myprocinfo()) == 0 || pi->cpu != 0)
+        exit(3);
+    }
+    if(pi->ru.nswitch - nswitch < 50)
+      exit(3);
+    if(set_affinity(0) != 1)
+      exit(4);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: pinned child failed with %d\n", s, xstatus);
+    exit(1);
+  }
+}
+
+// the trace device records system calls while tracing is on,
+// and nothing while it's off.
+void
+tracetest(char *s)
+{
+  struct trace_event ev[32];
+  int fd, n, calls = 0, rets = 0, pid = getpid();
+
+  if((fd = open("/dev/trace", O_RDWR)) < 0){
+    printf("%s: cannot open /dev/trace\n", s);
+    exit(1);
+  }
+  if(write(fd, "x", 1) != -1){
+    printf("%s: bad trace command accepted\n", s);
+    exit(1);
+  }
+  write(fd, "1", 1);
+  for(int i = 0; i < 3; i++)
+    getpid();
+  write(fd, "0", 1);
+  getpid();
+
+  while((n = read(fd, ev, sizeof(ev))) > 0){
+    if(n % sizeof(ev[0]) != 0){
+      printf("%s: read %d bytes, not whole events\n", s, n);
+      exit(1);
+    }
+    for(int i = 0; i < n / sizeof(ev[0]); i++){
+      if(ev[i].pid != pid || ev[i].arg != SYS_getpid)
+        continue;
+      if(ev[i].type == TRACE_SYSCALL)
+        calls++;
+      if(ev[i].type == TRACE_SYSRET)
+        rets++;
+    }
+  }
+  close(fd);
+  if(calls != 3 || rets != 3){
+    printf("%s: traced %d getpid calls and %d returns, not 3\n", s, calls, rets);
+    exit(1);
+  }
+}
+
+// a process's cpu time, system calls and page faults are counted,
+// handed to its parent by waitrusage(), and listed by procinfo().
+void
+rusagetest(char *s)
+{
+  struct rusage ru0, ru1, cru;
+  static struct procinfo pi[NPROC];
+  int pid, xstatus, n, found = 0;
+
+  if(getrusage(2, &ru0) != -1){
+    printf("%s: getrusage of nobody succeeded\n", s);
+    exit(1);
+  }
+  getrusage(RUSAGE_SELF, &ru0);
+  for(int i = 0; i < 10; i++)
+    getpid();
+  getrusage(RUSAGE_SELF, &ru1);
+  if(ru1.nsyscall - ru0.nsyscall < 11){
+    printf("%s: %d system calls counted, not 11\n", s, (int)(ru1.nsyscall - ru0.nsyscall));
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    // touch 10 fresh heap pages, then spin for 2 ticks
+    char *a = sbrk(10 * PGSIZE);
+    for(int i = 0; i < 10; i++)
+      a[i * PGSIZE] = 1;
+    int t0 = uptime();
+    while(uptime() - t0 < 2)
+      ;
+    exit(7);
+  }
+  if(waitrusage(&xstatus, &ru0) != pid || xstatus != 7){
+    printf("%s: waitrusage failed\n", s);
+    exit(1);
+  }
+  if(ru0.nfault < 10 || ru0.nsyscall < 2 || ru0.cputime < TICK_CYCLES){
+    printf("%s: child used %d faults %d syscalls %d cycles\n", s,
+           (int)ru0.nfault, (int)ru0.nsyscall, (int)ru0.cputime);
+    exit(1);
+  }
+  getrusage(RUSAGE_CHILDREN, &cru);
+  if(cru.cputime < ru0.cputime || cru.nfault < ru0.nfault){
+    printf("%s: children's usage doesn't include the child's\n", s);
+    exit(1);
+  }
+
+  n = procinfo(pi, NPROC);
+  for(int i = 0; i < n; i++)
+    if(pi[i].pid == getpid() && pi[i].ru.nsyscall > 0)
+      found = 1;
+  if(!found){
+    printf("%s: procinfo didn't list us\n", s);
+    exit(1);
+  }
+}
+
+// processes reading their own files at once, with more blocks
+// between them than fit in the buffer cache, each see only
+// their own data.
+void
+bcachetest(char *s)
+{
+  enum { N = 4, NB = 16 };
+  char name[] = "bct0";
+  static char buf[BSIZE];
+  int xstatus;
+
+  for(int i = 0; i < N; i++){
+    name[3] = '0' + i;
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      int fd = open(name, O_CREATE|O_RDWR);
+      if(fd < 0)
+        exit(1);
+      for(int b = 0; b < NB; b++){
+        memset(buf, 'a' + i + b, sizeof(buf));
+        if(write(fd, buf, sizeof(buf)) != sizeof(buf))
+          exit(2);
+      }
+      close(fd);
+      for(int r = 0; r < 3; r++){
+        if((fd = open(name, O_RDONLY)) < 0)
+          exit(3);
+        for(int b = 0; b < NB; b++){
+          if(read(fd, buf, sizeof(buf)) != sizeof(buf))
+            exit(4);
+          for(int j = 0; j < sizeof(buf); j++)
+            if(buf[j] != 'a' + i + b)
+              exit(5);
+        }
+        close(fd);
+      }
+      exit(0);
+    }
+  }
+  for(int i = 0; i < N; i++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: reader failed with %d\n", s, xstatus);
+      exit(1);
+    }
+  }
+  for(int i = 0; i < N; i++){
+    name[3] = '0' + i;
+    unlink(name);
+  }
+}
+
+// a file several times the size of the cache at boot stays cached
+// once it's been read: the cache grows to hold it.
+void
+bcachegrow(char *s)
+{
+  enum { NB = 200 };
+  static char buf[BSIZE];
+  struct rusage ru0, ru1;
+  int fd;
+
+  fd = open("bcg", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create bcg failed\n", s);
+    exit(1);
+  }
+  for(int b = 0; b < NB; b++){
+    memset(buf, b, sizeof(buf));
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  getrusage(RUSAGE_SELF, &ru0);
+  for(int r = 0; r < 2; r++){
+    if((fd = open("bcg", O_RDONLY)) < 0){
+      printf("%s: open bcg failed\n", s);
+      exit(1);
+    }
+    for(int b = 0; b < NB; b++){
+      if(read(fd, buf, sizeof(buf)) != sizeof(buf) || buf[0] != (char)b){
+        printf("%s: read back wrong data\n", s);
+        exit(1);
+      }
+    }
+    close(fd);
+  }
+  getrusage(RUSAGE_SELF, &ru1);
+  unlink("bcg");
+
+  // the blocks were all just written, so reading them needs the disk
+  // only for what another process pushed out meanwhile
+  if(ru1.nblockread - ru0.nblockread >= NB){
+    printf("%s: %d disk reads for %d cached blocks\n", s,
+           (int)(ru1.nblockread - ru0.nblockread), 2*NB);
+    exit(1);
+  }
+}
+
+// bcachestat() reports a sane cache size and counts reads of a
+// cached block as hits. it doesn't test scan resistance: that
+// needs a scan bigger than the cache, which can grow to NBUF_MAX
+// blocks, about half of the file system (see scanbench).
+void
+bcachestattest(char *s)
+{
+  struct bcachestat st0, st1;
+  char buf[64];
+  int fd;
+
+  if(bcachestat(&st0) < 0){
+    printf("%s: bcachestat failed\n", s);
+    exit(1);
+  }
+  if(st0.nbuf < NBUF || st0.nhot > st0.nbuf){
+    printf("%s: %d buffers, %d hot\n", s, (int)st0.nbuf, (int)st0.nhot);
+    exit(1);
+  }
+  for(int i = 0; i < 10; i++){
+    if((fd = open("README", O_RDONLY)) < 0){
+      printf("%s: open README failed\n", s);
+      exit(1);
+    }
+    read(fd, buf, sizeof(buf));
+    close(fd);
+  }
+  bcachestat(&st1);
+  if(st1.hits < st0.hits + 10){
+    printf("%s: %d hits for 10 cached reads\n", s, (int)(st1.hits - st0.hits));
+    exit(1);
+  }
+  if(st1.misses < st0.misses || st1.ghosthits > st1.misses){
+    printf("%s: counters went wrong\n", s);
+    exit(1);
+  }
+}
+
+// read programs that usertests doesn't run, in small reads and big
+// ones and through two descriptors at once, and check all see the
+// same. the blocks that had to come from the disk should mostly
+// have been read ahead, and a second pass needs the disk not at all.
+void
+readaheadtest(char *s)
+{
+  char *files[] = { "scanbench", "bcachebench", "latency" };
+  static char big[4096];
+  char small[100];
+  struct stat st;
+  struct rusage ru0, ru1;
+  struct bcachestat bs0, bs1;
+
+  for(int f = 0; f < sizeof(files)/sizeof(files[0]); f++){
+    int fd1 = open(files[f], O_RDONLY);
+    int fd2 = open(files[f], O_RDONLY);
+    if(fd1 < 0 || fd2 < 0){
+      printf("%s: open %s failed\n", s, files[f]);
+      exit(1);
+    }
+    fstat(fd1, &st);
+    getrusage(RUSAGE_SELF, &ru0);
+    bcachestat(&bs0);
+
+    // fd1 a little at a time, fd2 in between in big reads
+    uint sum1 = 0, sum2 = 0, n1 = 0, n2 = 0;
+    int r;
+    while((r = read(fd1, small, sizeof(small))) > 0){
+      for(int i = 0; i < r; i++)
+        sum1 = sum1 * 31 + (uchar)small[i];
+      n1 += r;
+      if(n1 % (40*sizeof(small)) == 0 && (r = read(fd2, big, sizeof(big))) > 0){
+        for(int i = 0; i < r; i++)
+          sum2 = sum2 * 31 + (uchar)big[i];
+        n2 += r;
+      }
+    }
+    while((r = read(fd2, big, sizeof(big))) > 0){
+      for(int i = 0; i < r; i++)
+        sum2 = sum2 * 31 + (uchar)big[i];
+      n2 += r;
+    }
+    close(fd1);
+    close(fd2);
+    if(n1 != st.size || n2 != st.size || sum1 != sum2){
+      printf("%s: %s read differently: %d and %d of %d bytes\n", s, files[f],
+             n1, n2, (int)st.size);
+      exit(1);
+    }
+
+    // (if an earlier run left the file cached, there's nothing to see)
+    getrusage(RUSAGE_SELF, &ru1);
+    bcachestat(&bs1);
+    int disk = ru1.nblockread - ru0.nblockread;
+    int ahead = bs1.readahead - bs0.readahead;
+    if(disk > 0 && ahead * 2 < disk){
+      printf("%s: %s: only %d of %d disk reads were read-ahead\n", s, files[f],
+             ahead, disk);
+      exit(1);
+    }
+
+    if((fd1 = open(files[f], O_RDONLY)) < 0){
+      printf("%s: open %s failed\n", s, files[f]);
+      exit(1);
+    }
+    while(read(fd1, big, sizeof(big)) > 0)
+      ;
+    close(fd1);
+    getrusage(RUSAGE_SELF, &ru0);
+    if(ru0.nblockread != ru1.nblockread){
+      printf("%s: %s: second pass read %d blocks from disk\n", s, files[f],
+             (int)(ru0.nblockread - ru1.nblockread));
+      exit(1);
+    }
+  }
+}
+
 void
 sbrkbasic(char *s)
 {
@@ -2559,6 +3589,72 @@ sbrklast(char *s)
 }
 
 
+// initialized, so it lives in the data segment, which exec()
+// leaves to be paged in from the file
+static int sbrkdata = 0x5a5a5a5a;
+
+// shrink into the data segment and grow back. the stack goes
+// too, so this runs in a thread with an mmap()ed stack and only
+// reports through the pipe fd it's given.
+static void
+sbrkseg_worker(void *arg)
+{
+  int fd = (int)(uint64)arg;
+  volatile int *p = &sbrkdata;
+  char *top = sbrk(0);
+  char *base = (char*)PGROUNDDOWN((uint64)p);
+  char r = 'y';
+
+  if(sbrk(base - top) == (char*)-1 || sbrk(top - base) == (char*)-1)
+    r = 's';
+  else if(*p != 0)      // read back from the executable
+    r = 'd';
+  else {
+    *p = 1;
+    if(*p != 1)
+      r = 'w';
+  }
+  write(fd, &r, 1);
+  for(;;)
+    ;
+}
+
+// memory sbrk() gives back and takes again is fresh zeroed
+// memory, even where the program's data segment used to be
+void
+sbrkseg(char *s)
+{
+  int fds[2], pid;
+  char r = 0;
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    char *stack = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(stack == (char*)-1 || clone(sbrkseg_worker, (void*)(uint64)fds[1], stack + PGSIZE) < 0)
+      exit(1);
+    join(0);
+    exit(1);
+  }
+  close(fds[1]);
+  read(fds[0], &r, 1);
+  close(fds[0]);
+  kill(pid);
+  wait(0);
+  if(r != 'y'){
+    printf("%s: regrown memory %s\n", s, r == 'd' ? "held the old data" :
+           r == 'w' ? "wasn't writable" : r == 's' ? "sbrk failed" : "killed the process");
+    exit(1);
+  }
+}
+
 // does sbrk handle signed int32 wrap-around with
 // negative arguments?
 void
@@ -2609,6 +3705,7 @@ struct test {
   {dirtest, "dirtest"},
   {exectest, "exectest"},
   {pipe1, "pipe1"},
+  {manypipes, "manypipes"},
   {killstatus, "killstatus"},
   {preempt, "preempt"},
   {exitwait, "exitwait"},
@@ -2633,6 +3730,20 @@ struct test {
   {dirfile, "dirfile"},
   {iref, "iref"},
   {forktest, "forktest"},
+  {cowfork, "cowfork"},
+  {lazysbrk, "lazysbrk"},
+  {mmaptest, "mmaptest"},
+  {quantum, "quantum"},
+  {nanosleeptest, "nanosleeptest"},
+  {clonetest, "clonetest"},
+  {futextest, "futextest"},
+  {affinitytest, "affinitytest"},
+  {tracetest, "tracetest"},
+  {rusagetest, "rusagetest"},
+  {bcachetest, "bcachetest"},
+  {bcachegrow, "bcachegrow"},
+  {bcachestattest, "bcachestattest"},
+  {readaheadtest, "readaheadtest"},
   {sbrkbasic, "sbrkbasic"},
   {sbrkmuch, "sbrkmuch"},
   {kernmem, "kernmem"},
@@ -2649,6 +3760,7 @@ struct test {
   {sbrkbugs, "sbrkbugs" },
   {sbrklast, "sbrklast"},
   {sbrk8000, "sbrk8000"},
+  {sbrkseg, "sbrkseg"},
   {badarg, "badarg" },
 
   { 0, 0},
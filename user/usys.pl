@@ -36,3 +36,18 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("kmemstat");
+entry("mmap");
+entry("munmap");
+entry("setquantum");
+entry("nanosleep");
+entry("clone");
+entry("join");
+entry("futex_wait");
+entry("futex_wake");
+entry("set_affinity");
+entry("cpustat");
+entry("getrusage");
+entry("waitrusage");
+entry("procinfo");
+entry("bcachestat");